@@ -0,0 +1,87 @@
+#include "SQLiteWrapper.h"
+#include <chrono>
+#include <cstdio>
+
+// This benchmark compares point lookups on a database file opened the default
+// way with lookups on the same file opened as an immutable snapshot, from
+// several threads at once.
+
+static std::string default_db_name(void) {
+  return "bench-immutable-lookups.db";
+}
+using default_db = sqlite::Database<default_db_name>;
+
+static std::string immutable_db_name(void) {
+  return default_db_name();
+}
+using immutable_db = sqlite::Database<immutable_db_name>;
+
+static const char create_table_query[]
+  = "create table kv (id integer primary key, value text not null)";
+static const char insert_query[] = "insert into kv values (?1, ?2)";
+static const char lookup_query[] = "select value from kv where id = ?1";
+
+static constexpr int num_rows = 500000;
+static constexpr int lookups_per_thread = 500000;
+
+// Run LOOKUPS_PER_THREAD point lookups of random rows on each of NUM_THREADS
+// threads, returning the average latency of a lookup.
+template <typename DB>
+static double ns_per_lookup(unsigned num_threads) {
+  std::atomic<std::size_t> checksum{0};
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < num_threads; t++) {
+    threads.emplace_back([t, &checksum] {
+      DB::connect();
+      std::uint64_t state = 0x9e3779b97f4a7c15 + t;
+      std::size_t local_checksum = 0;
+      std::string_view value;
+      for (int i = 0; i < lookups_per_thread; i++) {
+        state = state * 6364136223846793005 + 1442695040888963407;
+        auto id = static_cast<sqlite3_int64>((state >> 33) % num_rows);
+        if (DB::template query<lookup_query>(id)(value)) {
+          local_checksum += value.size();
+        }
+      }
+      checksum += local_checksum;
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (checksum == 0) {
+    std::fprintf(stderr, "no rows found\n");
+  }
+  return std::chrono::duration<double, std::nano>(end - start).count()
+         / lookups_per_thread;
+}
+
+int main(void) {
+  std::remove(default_db_name().c_str());
+  default_db::query<create_table_query>();
+  {
+    default_db::TransactionGuard txn;
+    for (int i = 0; i < num_rows; i++) {
+      default_db::query<insert_query>(i, "value-" + std::to_string(i));
+    }
+  }
+  default_db::disconnect();
+
+  immutable_db::immutable = true;
+
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::printf("point lookups (%d per thread over %d rows)\n",
+              lookups_per_thread, num_rows);
+  for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+    double default_ns = ns_per_lookup<default_db>(num_threads);
+    double immutable_ns = ns_per_lookup<immutable_db>(num_threads);
+    std::printf("  %2u threads: default %7.1f ns/lookup, "
+                "immutable %7.1f ns/lookup (%+.1f%%)\n",
+                num_threads, default_ns, immutable_ns,
+                100.0 * (immutable_ns / default_ns - 1));
+  }
+
+  std::remove(default_db_name().c_str());
+}
@@ -0,0 +1,103 @@
+#include "SQLiteWrapper.h"
+#include <chrono>
+#include <cstdio>
+
+// This benchmark compares point lookups through the wrapper with the same
+// lookups written directly against the SQLite C API, on the same connection.
+
+static const char db_name[] = ":memory:";
+using db = sqlite::Database<db_name>;
+
+static const char create_table_query[]
+  = R"(create table kv (id integer primary key, name text not null,
+                        score integer not null, note text))";
+static const char insert_query[] = "insert into kv values (?1, ?2, ?3, ?4)";
+static const char lookup_query[] = "select name, score, note from kv where id = ?1";
+
+static constexpr int num_rows = 100000;
+static constexpr int num_lookups = 2000000;
+
+// A deterministic sequence of row ids to look up.
+static std::vector<sqlite3_int64> lookup_ids(void) {
+  std::vector<sqlite3_int64> ids;
+  ids.reserve(num_lookups);
+  std::uint64_t state = 0x9e3779b97f4a7c15;
+  for (int i = 0; i < num_lookups; i++) {
+    state = state * 6364136223846793005 + 1442695040888963407;
+    ids.push_back(static_cast<sqlite3_int64>((state >> 33) % num_rows));
+  }
+  return ids;
+}
+
+template <typename Fn>
+static double time_ns_per_lookup(Fn &&fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count()
+         / num_lookups;
+}
+
+int main(void) {
+  db::Connection conn;
+  conn.query<create_table_query>();
+  static const char begin_query[] = "begin";
+  static const char commit_query[] = "commit";
+  conn.query<begin_query>();
+  for (int i = 0; i < num_rows; i++) {
+    std::string name = "name-" + std::to_string(i);
+    std::optional<std::string> note;
+    if (i % 3 == 0) {
+      note = "note-" + std::to_string(i);
+    }
+    conn.query<insert_query>(i, name, i * 7, note);
+  }
+  conn.query<commit_query>();
+
+  auto ids = lookup_ids();
+  std::size_t wrapper_checksum = 0, c_api_checksum = 0;
+
+  double wrapper_ns = time_ns_per_lookup([&] {
+    std::string_view name;
+    sqlite3_int64 score;
+    std::optional<std::string_view> note;
+    for (auto id : ids) {
+      auto fetch_row = conn.query<lookup_query>(id);
+      if (fetch_row(name, score, note)) {
+        wrapper_checksum += name.size() + score + (note ? note->size() : 0);
+      }
+    }
+  });
+
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v3(conn.handle(), lookup_query, sizeof(lookup_query),
+                     SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+  double c_api_ns = time_ns_per_lookup([&] {
+    for (auto id : ids) {
+      sqlite3_bind_int64(stmt, 1, id);
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string_view name((const char *)sqlite3_column_text(stmt, 0),
+                              sqlite3_column_bytes(stmt, 0));
+        sqlite3_int64 score = sqlite3_column_int64(stmt, 1);
+        std::size_t note_size = 0;
+        if (sqlite3_column_type(stmt, 2) != SQLITE_NULL) {
+          sqlite3_column_text(stmt, 2);
+          note_size = sqlite3_column_bytes(stmt, 2);
+        }
+        c_api_checksum += name.size() + score + note_size;
+      }
+      sqlite3_reset(stmt);
+    }
+  });
+  sqlite3_finalize(stmt);
+
+  if (wrapper_checksum != c_api_checksum) {
+    std::fprintf(stderr, "checksum mismatch: %zu != %zu\n",
+                 wrapper_checksum, c_api_checksum);
+    return 1;
+  }
+  std::printf("point lookups (%d over %d rows)\n", num_lookups, num_rows);
+  std::printf("  wrapper:    %7.1f ns/lookup\n", wrapper_ns);
+  std::printf("  C API:      %7.1f ns/lookup\n", c_api_ns);
+  std::printf("  overhead:   %7.1f%%\n", 100.0 * (wrapper_ns / c_api_ns - 1));
+}
@@ -18,15 +18,33 @@
 
 #include "sqlite3.h"
 
+#include <algorithm>
 #include <array>
+#include <charconv>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <optional>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <mutex>
 #include <iostream>
 #include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 
 namespace sqlite {
 
@@ -78,13 +96,6 @@ inline std::mutex sqlite3_config_mutex;
 // performed.
 inline bool sqlite3_configured = false;
 
-// This is the error log callback installed by the wrapper.
-//
-// TODO(ppalka): Make the choice of error log callback configurable.
-inline void sqlite_error_log_callback(void *, int err_code, const char *msg) {
-  std::cerr << "SQLite error (" << err_code << "): " << msg << std::endl;
-}
-
 } // namespace detail
 
 // Define an explicit specialization `user_serialize_fn<T>` or perhaps
@@ -133,18 +144,716 @@ class blob_view : public std::string_view {
   blob_view(Ts &&...args) : std::string_view(std::forward<Ts>(args)...) { }
 };
 
+// An `Arena` is a bump allocator for the bytes of TEXT and BLOB columns.  A
+// QueryResult that uses an arena copies the columns it fetches into
+// `std::string_view`s and `sqlite::blob_view`s into the arena, so that the
+// views remain valid until the arena is reset or destroyed rather than only
+// until the next row is fetched.  Memory is obtained in blocks of
+// `block_size` bytes, and `reset()` keeps those blocks around for reuse, so
+// that materializing a batch of rows costs a handful of allocations instead
+// of one per cell.
+class Arena {
+ public:
+  explicit Arena(std::size_t block_size_ = 64 * 1024)
+    : block_size(block_size_) { }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Copy the LEN bytes at PTR into the arena and return the copy.
+  const char *copy(const char *ptr, std::size_t len) {
+    if (len == 0) {
+      return ptr;
+    }
+    char *dest = allocate(len);
+    std::memcpy(dest, ptr, len);
+    return dest;
+  }
+
+  // Return LEN bytes of uninitialized memory owned by the arena.
+  char *allocate(std::size_t len) {
+    bytes_used += len;
+    // Requests that would waste much of a block get a block of their own.
+    if (len > block_size / 4) {
+      large_blocks.emplace_back(new char[len]);
+      return large_blocks.back().get();
+    }
+    if (blocks.empty() || offset + len > block_size) {
+      if (blocks.empty() || ++current_block == blocks.size()) {
+        blocks.emplace_back(new char[block_size]);
+        current_block = blocks.size() - 1;
+      }
+      offset = 0;
+    }
+    char *dest = blocks[current_block].get() + offset;
+    offset += len;
+    return dest;
+  }
+
+  // Invalidate everything allocated from the arena, keeping its blocks for
+  // reuse.
+  void reset(void) {
+    large_blocks.clear();
+    current_block = 0;
+    offset = 0;
+    bytes_used = 0;
+  }
+
+  // The number of bytes allocated since the arena was created or last reset.
+  std::size_t bytesUsed(void) const {
+    return bytes_used;
+  }
+
+ private:
+  const std::size_t block_size;
+  std::vector<std::unique_ptr<char[]>> blocks;
+  std::vector<std::unique_ptr<char[]>> large_blocks;
+  std::size_t current_block = 0;
+  std::size_t offset = 0;
+  std::size_t bytes_used = 0;
+};
+
 // The class of SQLite errors.  When an exceptional error is encountered, we
 // throw an exception of this type.
 class error : public std::exception {
  public:
   int err_code;
-  error (int code) : err_code(code) { }
+
+  // The extended result code, or `err_code` if there is none.
+  int extended_code;
+
+  // SQLite's description of the error, from sqlite3_errmsg if the error
+  // happened on a connection.
+  std::string message;
+
+  // The query that failed, if any.  This views the wrapper's static copy of
+  // the query string, so it stays valid after the connection is closed.
+  std::string_view query;
+
+  error (int code) : err_code(code), extended_code(code) { }
+
+  // Capture the details of the most recent error on DB_HANDLE, which must
+  // not have been used since by another thread.
+  error (int code, sqlite3 *db_handle, std::string_view query_ = {})
+    : err_code(code), extended_code(code), query(query_) {
+    if (db_handle != nullptr && sqlite3_errcode(db_handle) == code) {
+      extended_code = sqlite3_extended_errcode(db_handle);
+      message = sqlite3_errmsg(db_handle);
+    }
+  }
+
+  const char *what(void) const noexcept override {
+    return message.empty() ? sqlite3_errstr(err_code) : message.c_str();
+  }
+};
+
+// A half-open range [first, last) of integer keys (typically rowids).  See
+// `Database::parallelScan`.
+struct KeyRange {
+  sqlite3_int64 first;
+  sqlite3_int64 last;
+};
+
+// Split the key range [first, last) into at most `partitions` contiguous
+// ranges of nearly equal size.
+inline std::vector<KeyRange> splitKeyRange(sqlite3_int64 first,
+                                           sqlite3_int64 last,
+                                           unsigned partitions) {
+  std::vector<KeyRange> ranges;
+  if (last <= first || partitions == 0) {
+    return ranges;
+  }
+  auto span = static_cast<sqlite3_uint64>(last) - static_cast<sqlite3_uint64>(first);
+  if (span < partitions) {
+    partitions = static_cast<unsigned>(span);
+  }
+  auto step = span / partitions;
+  auto remainder = span % partitions;
+  // Keep the running bound unsigned: the signed sum would overflow for spans
+  // wider than INT64_MAX.
+  auto begin = static_cast<sqlite3_uint64>(first);
+  for (unsigned i = 0; i < partitions; i++) {
+    auto end = begin + step + (i < remainder);
+    ranges.push_back({static_cast<sqlite3_int64>(begin),
+                      static_cast<sqlite3_int64>(end)});
+    begin = end;
+  }
+  return ranges;
+}
+
+// Options for `Database::importCsv` and `Database::importNdjson`.
+struct ImportOptions {
+  // Whether the first CSV line is a header, to be skipped.
+  bool header = false;
+
+  // Commit a transaction after this many rows.  Zero imports everything in a
+  // single transaction.
+  std::size_t rows_per_transaction = 100000;
+
+  // The number of threads parsing the input; zero means one per hardware
+  // thread.
+  unsigned threads = 0;
+
+  // The approximate number of bytes of input handed to a parser at a time.
+  std::size_t chunk_size = 1 << 20;
+
+  // Whether unquoted empty CSV fields are bound as NULL rather than as empty
+  // strings.
+  bool empty_as_null = false;
+};
+
+// How SQLite executes a query, as reported by `EXPLAIN QUERY PLAN`.  See
+// `Database::query_plan_hook`.
+struct QueryPlan {
+  // The query string as given to `query()`.
+  std::string_view query;
+  // The detail column of each row of the plan, in order.
+  std::vector<std::string> steps;
+  // Whether some step scans a whole table or index (a `SCAN` step).
+  bool full_scan = false;
+  // Whether some step builds a temporary B-tree, e.g. for ORDER BY, GROUP BY
+  // or DISTINCT.
+  bool temp_btree = false;
+};
+
+namespace detail {
+
+// Fill PLAN with the output of `EXPLAIN QUERY PLAN` for its query on the
+// connection DB_HANDLE.
+inline void explain_query_plan(sqlite3 *db_handle, QueryPlan &plan) {
+  std::string explain_query = "explain query plan ";
+  explain_query.append(plan.query);
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db_handle, explain_query.c_str(),
+                         static_cast<int>(explain_query.size()) + 1,
+                         &stmt, nullptr) != SQLITE_OK) {
+    return;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    auto ptr = (const char *)sqlite3_column_text(stmt, 3);
+    std::string_view step(ptr ? ptr : "", sqlite3_column_bytes(stmt, 3));
+    if (step.substr(0, 5) == "SCAN " && step != "SCAN CONSTANT ROW") {
+      plan.full_scan = true;
+    }
+    if (step.find("USE TEMP B-TREE") != std::string_view::npos) {
+      plan.temp_btree = true;
+    }
+    plan.steps.emplace_back(step);
+  }
+  sqlite3_finalize(stmt);
+}
+
+} // namespace detail
+
+// Options controlling how SQLite allocates memory.  See `configureMemory`.
+struct MemoryOptions {
+  // Serve SQLite's allocations from per-thread pools of size-classed blocks
+  // rather than going to the system allocator every time.  Blocks freed by a
+  // thread are kept for reuse by that thread, so threads with their own
+  // connections rarely contend with one another inside the allocator.
+  bool thread_local_pools = false;
+
+  // Whether SQLite keeps its global memory statistics
+  // (SQLITE_CONFIG_MEMSTATUS).  Every allocation updates them under a global
+  // mutex, so turn this off in heavily multi-threaded programs.
+  bool memstatus = true;
+
+  // The size and number of the lookaside slots configured on each new
+  // connection (SQLITE_DBCONFIG_LOOKASIDE).  Zero keeps SQLite's defaults.
+  int lookaside_slot_size = 0;
+  int lookaside_slot_count = 0;
+};
+
+// Allocation statistics of the thread-local pools, summed over all threads.
+// All are zero unless `MemoryOptions::thread_local_pools` is set.
+struct MemoryStats {
+  // Bytes currently handed out to SQLite, rounded up to their size class.
+  sqlite3_int64 bytes_in_use = 0;
+  // Bytes sitting in the pools' free lists, available for reuse.
+  sqlite3_int64 bytes_cached = 0;
+  // Number of allocations made by SQLite.
+  sqlite3_int64 allocations = 0;
+  // Number of those allocations that were served from a pool.
+  sqlite3_int64 pool_hits = 0;
+};
+
+// Limits on the memory used by the page caches of a database's connections.
+// See `Database::memory_budget`.
+struct MemoryBudget {
+  // Open connections in SQLite's shared-cache mode, so that all connections
+  // of the process to the same database file share one page cache instead of
+  // each keeping its own copy of hot pages.  In this mode, conflicting
+  // accesses to a table by two connections are resolved with table-level
+  // locks, which a statement takes when it starts.  If a statement finds a
+  // table locked, the wrapper waits for the lock to be released, up to
+  // `shared_cache_lock_timeout` (or, when SQLite is built with
+  // SQLITE_ENABLE_UNLOCK_NOTIFY, until SQLite reports a deadlock).  Past that
+  // the statement's result code is SQLITE_LOCKED.  A lock hit after a
+  // statement has returned rows ends the results with SQLITE_LOCKED as well,
+  // since the statement can't be restarted without repeating them.
+  bool shared_cache = false;
+
+  // How long to wait for a shared-cache table lock before giving up.
+  std::chrono::milliseconds shared_cache_lock_timeout{1000};
+
+  // The maximum size of each connection's page cache (or of the shared cache)
+  // in KiB, set with `pragma cache_size`.  Zero keeps SQLite's default.
+  sqlite3_int64 cache_size_kib = 0;
+
+  // A process-wide soft limit on the memory SQLite allocates, in bytes (see
+  // sqlite3_soft_heap_limit64).  SQLite recycles cached pages rather than
+  // allocate past the limit.  Zero leaves the limit alone.  This relies on
+  // `MemoryOptions::memstatus` being left on.
+  sqlite3_int64 soft_heap_limit = 0;
+};
+
+// A change made to a row of a rowid table.  See `Database::subscribe`.
+struct RowChange {
+  // SQLITE_INSERT, SQLITE_UPDATE or SQLITE_DELETE.
+  int operation;
+  // The name of the database ("main", "temp" or that of an attached one).
+  std::string database;
+  std::string table;
+  sqlite3_int64 rowid;
+};
+
+// The row changes made by one committed transaction, in the order they were
+// made.
+using ChangeBatch = std::vector<RowChange>;
+
+// Page cache statistics of a connection, from sqlite3_db_status.
+struct CacheStats {
+  // Bytes of page cache used by the connection, counting a shared cache in
+  // full.
+  int cache_used = 0;
+  // Bytes of page cache used by the connection, with a shared cache split
+  // evenly between the connections sharing it.
+  int cache_used_shared = 0;
+  int cache_hits = 0;
+  int cache_misses = 0;
+  int cache_writes = 0;
+};
+
+// Where and how often the messages SQLite logs through SQLITE_CONFIG_LOG are
+// reported.  See `configureLogging`.
+struct LogOptions {
+  // Called on a background thread with each message's result code and text.
+  // By default messages are written to std::cerr; an empty sink discards
+  // them.
+  std::function<void(int err_code, std::string_view msg)> sink
+    = [] (int err_code, std::string_view msg) {
+        std::string line = "SQLite error (" + std::to_string(err_code) + "): ";
+        line.append(msg).push_back('\n');
+        std::cerr << line;
+      };
+
+  // The most messages reported per second; the excess is dropped and only
+  // counted, and the count is reported as a message of its own.  Zero means
+  // no limit.
+  std::size_t max_messages_per_second = 100;
 };
 
 namespace detail {
 
+inline MemoryOptions memory_options;
+
+// The pool allocator installed with SQLITE_CONFIG_MALLOC.  Every block starts
+// with a header recording its usable size; blocks of up to
+// `max_pooled_size` bytes are rounded up to a size class and, when freed, are
+// put on the freeing thread's free list for that class.
+namespace pool {
+
+struct alignas(16) BlockHeader {
+  sqlite3_uint64 size;
+};
+
+struct FreeBlock {
+  FreeBlock *next;
+};
+
+inline constexpr std::size_t max_pooled_size = 64 * 1024;
+inline constexpr std::size_t num_size_classes = 16 + 8;
+inline constexpr std::size_t max_cached_bytes_per_class = 256 * 1024;
+
+// Size classes are multiples of 16 bytes up to 256 bytes, then powers of two
+// up to `max_pooled_size`.
+inline constexpr std::size_t size_class_of(std::size_t size) {
+  if (size <= 256) {
+    return size == 0 ? 0 : (size - 1) / 16;
+  }
+  std::size_t size_class = 16;
+  for (std::size_t class_size = 512; class_size < size; class_size *= 2) {
+    size_class++;
+  }
+  return size_class;
+}
+
+inline constexpr std::size_t class_size_of(std::size_t size_class) {
+  if (size_class < 16) {
+    return (size_class + 1) * 16;
+  }
+  return std::size_t{512} << (size_class - 16);
+}
+
+inline constexpr std::size_t round_up(std::size_t size) {
+  if (size <= max_pooled_size) {
+    return class_size_of(size_class_of(size));
+  }
+  return (size + 15) & ~std::size_t{15};
+}
+
+// A counter written only by the thread owning it but readable from any
+// thread.  Writes are plain loads and stores, which unlike read-modify-write
+// operations need no bus lock.
+class Counter {
+ public:
+  void add(sqlite3_int64 delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
+  }
+  sqlite3_int64 get(void) const {
+    return value.load(std::memory_order_relaxed);
+  }
+ private:
+  std::atomic<sqlite3_int64> value{0};
+};
+
+struct Stats {
+  Counter bytes_in_use, bytes_cached, allocations, pool_hits;
+
+  void accumulate_into(MemoryStats &total) const {
+    total.bytes_in_use += bytes_in_use.get();
+    total.bytes_cached += bytes_cached.get();
+    total.allocations += allocations.get();
+    total.pool_hits += pool_hits.get();
+  }
+};
+
+class ThreadPool;
+
+// Registry of live thread pools, so that statistics can be summed.  Only
+// touched when a thread creates or destroys its pool.
+inline std::mutex registry_mutex;
+inline std::vector<ThreadPool *> registry;
+// Statistics of threads which have exited, and of allocations made or freed
+// by threads whose pool is already gone.
+inline MemoryStats retired_stats;
+
+inline thread_local ThreadPool *tls_pool = nullptr;
+inline thread_local bool tls_pool_destroyed = false;
+
+// The per-thread pool.  Its free lists hold whole blocks, header included, so
+// that a block can be handed out again without touching the system allocator.
+class ThreadPool {
+ public:
+  ThreadPool(void) {
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    registry.push_back(this);
+  }
+
+  ~ThreadPool(void) {
+    for (std::size_t i = 0; i < num_size_classes; i++) {
+      while (free_lists[i] != nullptr) {
+        std::free(std::exchange(free_lists[i], free_lists[i]->next));
+      }
+    }
+    stats.bytes_cached.add(-stats.bytes_cached.get());
+    tls_pool = nullptr;
+    tls_pool_destroyed = true;
+
+    std::lock_guard<std::mutex> guard(registry_mutex);
+    stats.accumulate_into(retired_stats);
+    registry.erase(std::find(registry.begin(), registry.end(), this));
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  void *allocate(std::size_t size_class) {
+    if (free_lists[size_class] != nullptr) {
+      FreeBlock *block = free_lists[size_class];
+      free_lists[size_class] = block->next;
+      cached_bytes[size_class] -= class_size_of(size_class);
+      stats.bytes_cached.add(-static_cast<sqlite3_int64>(class_size_of(size_class)));
+      stats.pool_hits.add(1);
+      return block;
+    }
+    return nullptr;
+  }
+
+  // Returns false if the free list for the block's class is full.
+  bool deallocate(void *payload, std::size_t size_class) {
+    auto class_size = class_size_of(size_class);
+    if (cached_bytes[size_class] + class_size > max_cached_bytes_per_class) {
+      return false;
+    }
+    auto *block = static_cast<FreeBlock *>(payload);
+    block->next = free_lists[size_class];
+    free_lists[size_class] = block;
+    cached_bytes[size_class] += class_size;
+    stats.bytes_cached.add(static_cast<sqlite3_int64>(class_size));
+    return true;
+  }
+
+  Stats stats;
+
+ private:
+  FreeBlock *free_lists[num_size_classes] = {};
+  std::size_t cached_bytes[num_size_classes] = {};
+};
+
+inline ThreadPool *thread_pool(void) {
+  if (tls_pool == nullptr && !tls_pool_destroyed) {
+    static thread_local ThreadPool pool;
+    tls_pool = &pool;
+  }
+  return tls_pool;
+}
+
+inline void count_without_pool(sqlite3_int64 bytes, bool is_allocation) {
+  std::lock_guard<std::mutex> guard(registry_mutex);
+  retired_stats.bytes_in_use += bytes;
+  retired_stats.allocations += is_allocation;
+}
+
+inline void *mem_malloc(int n) {
+  auto size = round_up(static_cast<std::size_t>(n));
+  ThreadPool *pool = thread_pool();
+  void *block = nullptr;
+  if (pool != nullptr && size <= max_pooled_size) {
+    block = pool->allocate(size_class_of(size));
+  }
+  if (block == nullptr) {
+    block = std::malloc(sizeof(BlockHeader) + size);
+    if (block == nullptr) {
+      return nullptr;
+    }
+  }
+  auto *header = static_cast<BlockHeader *>(block);
+  header->size = size;
+  if (pool != nullptr) {
+    pool->stats.bytes_in_use.add(static_cast<sqlite3_int64>(size));
+    pool->stats.allocations.add(1);
+  } else {
+    count_without_pool(static_cast<sqlite3_int64>(size), true);
+  }
+  return header + 1;
+}
+
+inline void mem_free(void *payload) {
+  if (payload == nullptr) {
+    return;
+  }
+  auto *header = static_cast<BlockHeader *>(payload) - 1;
+  auto size = static_cast<std::size_t>(header->size);
+  ThreadPool *pool = thread_pool();
+  if (pool != nullptr) {
+    pool->stats.bytes_in_use.add(-static_cast<sqlite3_int64>(size));
+    if (size <= max_pooled_size &&
+        pool->deallocate(header, size_class_of(size))) {
+      return;
+    }
+  } else {
+    count_without_pool(-static_cast<sqlite3_int64>(size), false);
+  }
+  std::free(header);
+}
+
+inline int mem_size(void *payload) {
+  if (payload == nullptr) {
+    return 0;
+  }
+  return static_cast<int>((static_cast<BlockHeader *>(payload) - 1)->size);
+}
+
+inline void *mem_realloc(void *payload, int n) {
+  auto old_size = static_cast<std::size_t>(mem_size(payload));
+  if (round_up(static_cast<std::size_t>(n)) == old_size) {
+    return payload;
+  }
+  void *new_payload = mem_malloc(n);
+  if (new_payload == nullptr) {
+    return nullptr;
+  }
+  std::memcpy(new_payload, payload,
+              std::min(old_size, static_cast<std::size_t>(n)));
+  mem_free(payload);
+  return new_payload;
+}
+
+inline int mem_roundup(int n) {
+  return static_cast<int>(round_up(static_cast<std::size_t>(n)));
+}
+
+inline int mem_init(void *) {
+  return SQLITE_OK;
+}
+
+inline void mem_shutdown(void *) { }
+
+inline sqlite3_mem_methods mem_methods = {
+  mem_malloc, mem_free, mem_realloc, mem_size, mem_roundup,
+  mem_init, mem_shutdown, nullptr
+};
+
+} // namespace pool
+
 inline std::vector<std::function<void(sqlite3 *)>> function_creation_hooks;
 
+// Each query is assigned a slot in the statement cache of every connection.
+inline std::atomic<std::size_t> next_stmt_slot{0};
+
+// A `StmtHome` holds the prepared statements available for reuse for one
+// query on one connection.  Each `QueryResult` keeps a pointer to the home its
+// statement came from, so that the statement finds its way back there no
+// matter which thread ends up destroying the `QueryResult`.
+//
+// Statements returned on the owning thread go straight onto the free list.
+// Statements returned from any other thread are pushed onto a lock-free stack
+// and flag the owning connection, which drains the stacks of all its homes at
+// the start of its next query, so that such a statement doesn't keep a read
+// transaction open any longer than that.  A home
+// without an owning thread belongs to an explicit connection, which is only
+// used by one thread at a time, so all statements go straight onto its free
+// list unless the connection is serialized.  The home
+// is reference counted (one reference for the owning cache plus one per
+// statement currently held by a `QueryResult`) so that it outlives the owning
+// thread's cache if need be.
+class StmtHome {
+ public:
+  StmtHome(std::thread::id owner_, bool serialized_,
+           std::shared_ptr<std::atomic<bool>> returns_pending_)
+    : owner(owner_), serialized(serialized_),
+      returns_pending(std::move(returns_pending_)) { }
+
+  StmtHome(const StmtHome &) = delete;
+  StmtHome &operator=(const StmtHome &) = delete;
+
+  // Take a statement available for reuse, or return nullptr if there is none.
+  // This must only be called by the thread using the owning connection.
+  sqlite3_stmt *take(void) {
+    if (returned_stmts.load(std::memory_order_relaxed) != nullptr) {
+      reclaim();
+    }
+    sqlite3_stmt *stmt = nullptr;
+    if (first_free_stmt != nullptr) {
+      std::swap(first_free_stmt, stmt);
+    } else if (!other_free_stmts.empty()) {
+      stmt = other_free_stmts.back();
+      other_free_stmts.pop_back();
+    }
+    return stmt;
+  }
+
+  // Record that a statement taken from (or prepared for) this home is now held
+  // by a `QueryResult`.
+  void retain(void) {
+    refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Give back a statement previously retained.  This may be called from any
+  // thread.
+  void put(sqlite3_stmt *stmt) {
+    if (owner_alive.load(std::memory_order_acquire) &&
+        (owner == std::this_thread::get_id() ||
+         (owner == std::thread::id() && !serialized))) {
+      sqlite3_clear_bindings(stmt);
+      sqlite3_reset(stmt);
+      push_free(stmt);
+    } else {
+      // Only touch the connection from a foreign thread if SQLite serializes
+      // access to it for us.  Otherwise the owning thread resets the statement
+      // when it reclaims it.
+      if (serialized) {
+        sqlite3_clear_bindings(stmt);
+        sqlite3_reset(stmt);
+      }
+      auto *node = new ReturnedStmt{stmt,
+                                    returned_stmts.load(std::memory_order_relaxed)};
+      while (!returned_stmts.compare_exchange_weak(node->next, node,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed)) {
+        ;
+      }
+      returns_pending->store(true, std::memory_order_release);
+    }
+    release();
+  }
+
+  // Called by the owning thread when its cache goes away.  Statements still
+  // held by `QueryResult`s get finalized when they are given back.
+  void close(void) {
+    owner_alive.store(false, std::memory_order_release);
+    sqlite3_finalize(first_free_stmt);
+    first_free_stmt = nullptr;
+    for (auto stmt : other_free_stmts) {
+      sqlite3_finalize(stmt);
+    }
+    other_free_stmts.clear();
+    release();
+  }
+
+  // Reset the statements given back from other threads and make them
+  // available for reuse.  This must only be called by the thread using the
+  // owning connection.
+  void reclaim(void) {
+    ReturnedStmt *node = returned_stmts.exchange(nullptr,
+                                                 std::memory_order_acquire);
+    while (node != nullptr) {
+      sqlite3_clear_bindings(node->stmt);
+      sqlite3_reset(node->stmt);
+      push_free(node->stmt);
+      delete std::exchange(node, node->next);
+    }
+  }
+
+  // The query the statements are prepared from, for error reports.  Set by
+  // the owning thread when it prepares the first statement.
+  std::string_view query;
+
+ private:
+  struct ReturnedStmt {
+    sqlite3_stmt *stmt;
+    ReturnedStmt *next;
+  };
+
+  ~StmtHome(void) {
+    ReturnedStmt *node = returned_stmts.exchange(nullptr,
+                                                 std::memory_order_acquire);
+    while (node != nullptr) {
+      sqlite3_finalize(node->stmt);
+      delete std::exchange(node, node->next);
+    }
+  }
+
+  void release(void) {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  void push_free(sqlite3_stmt *stmt) {
+    if (first_free_stmt == nullptr) {
+      first_free_stmt = stmt;
+    } else {
+      other_free_stmts.push_back(stmt);
+    }
+  }
+
+  const std::thread::id owner;
+  const bool serialized;
+  // Set when a statement is pushed onto `returned_stmts`; shared by all the
+  // homes of the owning connection.
+  const std::shared_ptr<std::atomic<bool>> returns_pending;
+  // Cleared by the owning thread in `close()`, while other threads may be
+  // giving statements back.
+  std::atomic<bool> owner_alive{true};
+  std::atomic<std::size_t> refs{1};
+  std::atomic<ReturnedStmt *> returned_stmts{nullptr};
+  sqlite3_stmt *first_free_stmt = nullptr;
+  std::vector<sqlite3_stmt *> other_free_stmts;
+};
+
 template <typename T>
 struct decay_tuple_args {
   static_assert(dependent_false<T>);
@@ -155,8 +864,976 @@ struct decay_tuple_args<std::tuple<Ts...>> {
   using type = std::tuple<std::decay_t<Ts>...>;
 };
 
+// Return a URI filename opening the database file at PATH as immutable.
+inline std::string immutable_uri(std::string_view path) {
+  static const char hex_digits[] = "0123456789abcdef";
+  std::string uri = "file:";
+  for (char c : path) {
+    // These characters would otherwise be taken as URI delimiters.
+    if (c == '?' || c == '#' || c == '%') {
+      uri.push_back('%');
+      uri.push_back(hex_digits[static_cast<unsigned char>(c) >> 4]);
+      uri.push_back(hex_digits[static_cast<unsigned char>(c) & 0xf]);
+    } else {
+      uri.push_back(c);
+    }
+  }
+  uri.append("?immutable=1");
+  return uri;
+}
+
+// A `LogRing` takes the messages SQLite logs and hands them to the log sink on
+// a background thread of its own, so that a thread hitting an error doesn't
+// wait on the sink, nor on other threads logging at the same time.  Messages
+// go through a bounded lock-free ring of fixed-size slots (Vyukov's bounded
+// queue); when the ring is full or the rate limit is reached, messages are
+// counted and dropped instead.
+class LogRing {
+ public:
+  LogRing(void) {
+    for (std::size_t i = 0; i < capacity; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  LogRing(const LogRing &) = delete;
+  LogRing &operator=(const LogRing &) = delete;
+
+  ~LogRing(void) {
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      stopping = true;
+    }
+    wake_cv.notify_one();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  void configure(const LogOptions &options_) {
+    std::lock_guard<std::mutex> guard(sink_mutex);
+    options = options_;
+    max_per_second.store(options.max_messages_per_second,
+                         std::memory_order_relaxed);
+    // Start a fresh window, so that the new limit isn't already used up by
+    // messages counted under the old one.
+    count_in_window.store(0, std::memory_order_relaxed);
+  }
+
+  // Queue a message.  Apart from starting the background thread the first
+  // time, this doesn't allocate, and it only takes a mutex, briefly, to wake
+  // the background thread when it's asleep.
+  void push(int err_code, const char *msg) {
+    if (!within_rate()) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    auto pos = tail.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+      slot = &slots[pos % capacity];
+      auto sequence = slot->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(sequence - pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    slot->err_code = err_code;
+    slot->len = std::min(std::strlen(msg), sizeof(slot->text));
+    std::memcpy(slot->text, msg, slot->len);
+    // Publishing the slot and then checking `sleeping` pairs with `run`
+    // setting `sleeping` and then checking the slot; both sides being
+    // sequentially consistent, at least one of them sees the other's store.
+    slot->sequence.store(pos + 1, std::memory_order_seq_cst);
+
+    std::call_once(thread_started, [this] {
+      std::lock_guard<std::mutex> guard(mutex);
+      thread = std::thread([this] { run(); });
+    });
+    if (sleeping.load(std::memory_order_seq_cst)) {
+      // Notifying under the mutex keeps the notification from falling
+      // between `run` checking the slot and starting to wait.
+      std::lock_guard<std::mutex> guard(mutex);
+      wake_cv.notify_one();
+    }
+  }
+
+  // Block until every message queued so far, and the count of those dropped,
+  // has been handed to the sink.
+  void flush(void) {
+    auto target = tail.load();
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!thread.joinable()) {
+      return;
+    }
+    auto ticket = ++flush_requests;
+    wake_cv.notify_one();
+    flushed_cv.wait(lock, [this, target, ticket] {
+      return (static_cast<std::ptrdiff_t>(delivered - target) >= 0 &&
+              static_cast<std::ptrdiff_t>(flushes_done - ticket) >= 0) ||
+             stopping;
+    });
+  }
+
+ private:
+  static constexpr std::size_t capacity = 256;
+
+  struct Slot {
+    std::atomic<std::size_t> sequence;
+    int err_code;
+    std::size_t len;
+    char text[240];
+  };
+
+  bool within_rate(void) {
+    auto limit = max_per_second.load(std::memory_order_relaxed);
+    if (limit == 0) {
+      return true;
+    }
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    auto window = current_window.load(std::memory_order_relaxed);
+    if (window != now &&
+        current_window.compare_exchange_strong(window, now,
+                                               std::memory_order_relaxed)) {
+      count_in_window.store(0, std::memory_order_relaxed);
+    }
+    return count_in_window.fetch_add(1, std::memory_order_relaxed) < limit;
+  }
+
+  void run(void) {
+    std::string text;
+    std::size_t serving = 0;
+    for (;;) {
+      // Deliver whatever is queued.
+      while (true) {
+        Slot &slot = slots[head % capacity];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1) {
+          break;
+        }
+        int err_code = slot.err_code;
+        text.assign(slot.text, slot.len);
+        slot.sequence.store(head + capacity, std::memory_order_release);
+        head++;
+        deliver(err_code, text);
+      }
+      deliver_dropped();
+
+      std::unique_lock<std::mutex> lock(mutex);
+      delivered = head;
+      flushes_done = serving;
+      flushed_cv.notify_all();
+      if (stopping) {
+        return;
+      }
+      // See `push`.  A slot claimed but not yet published when we check it
+      // is published later, by a producer that then finds us asleep.
+      sleeping.store(true, std::memory_order_seq_cst);
+      wake_cv.wait(lock, [this, serving] {
+        return stopping || flush_requests != serving ||
+               slots[head % capacity].sequence.load(
+                   std::memory_order_seq_cst) == head + 1;
+      });
+      sleeping.store(false, std::memory_order_relaxed);
+      serving = flush_requests;
+    }
+  }
+
+  void deliver(int err_code, std::string_view text) {
+    std::lock_guard<std::mutex> guard(sink_mutex);
+    if (!options.sink) {
+      return;
+    }
+    try {
+      options.sink(err_code, text);
+    } catch (...) {
+      // There's no one to report a sink's failure to.
+    }
+  }
+
+  void deliver_dropped(void) {
+    if (auto count = dropped.exchange(0, std::memory_order_relaxed)) {
+      deliver(SQLITE_WARNING, std::to_string(count) + " log messages dropped");
+    }
+  }
+
+  Slot slots[capacity];
+  std::atomic<std::size_t> tail{0};
+  std::size_t head = 0;
+  std::atomic<std::size_t> dropped{0};
+
+  std::atomic<std::size_t> max_per_second{LogOptions().max_messages_per_second};
+  std::atomic<long long> current_window{0};
+  std::atomic<std::size_t> count_in_window{0};
+
+  std::mutex sink_mutex;
+  LogOptions options;
+
+  std::once_flag thread_started;
+  std::thread thread;
+  std::atomic<bool> sleeping{false};
+  std::mutex mutex;
+  std::condition_variable wake_cv;
+  std::condition_variable flushed_cv;
+  std::size_t delivered = 0;
+  std::size_t flush_requests = 0;
+  std::size_t flushes_done = 0;
+  bool stopping = false;
+};
+
+inline LogRing log_ring;
+
+// This is the error log callback installed by the wrapper.  See
+// `configureLogging`.
+inline void sqlite_error_log_callback(void *, int err_code, const char *msg) {
+  log_ring.push(err_code, msg);
+}
+
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+struct UnlockNotification {
+  bool fired = false;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+inline void unlock_notify_callback(void **args, int num_args) {
+  for (int i = 0; i < num_args; i++) {
+    auto *notification = static_cast<UnlockNotification *>(args[i]);
+    std::lock_guard<std::mutex> guard(notification->mutex);
+    notification->fired = true;
+    notification->cv.notify_one();
+  }
+}
+
+// Block until the shared-cache lock that made the last statement on DB_HANDLE
+// fail is released.  Returns SQLITE_LOCKED instead if waiting would deadlock.
+inline int wait_for_unlock_notify(sqlite3 *db_handle) {
+  UnlockNotification notification;
+  int ret = sqlite3_unlock_notify(db_handle, unlock_notify_callback,
+                                  &notification);
+  if (ret == SQLITE_OK) {
+    std::unique_lock<std::mutex> lock(notification.mutex);
+    notification.cv.wait(lock, [&] { return notification.fired; });
+  }
+  return ret;
+}
+#endif
+
+// A `ChangeDispatcher` delivers the batches of row changes made by committed
+// transactions to subscribers, in commit order, on a background thread of its
+// own.  This keeps subscribers from running inside SQLite's commit hook, and
+// on the committing thread.
+class ChangeDispatcher {
+ public:
+  ChangeDispatcher(void) = default;
+
+  ChangeDispatcher(const ChangeDispatcher &) = delete;
+  ChangeDispatcher &operator=(const ChangeDispatcher &) = delete;
+
+  ~ChangeDispatcher(void) {
+    {
+      std::lock_guard<std::mutex> guard(queue_mutex);
+      stopping = true;
+    }
+    queue_cv.notify_one();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  // Whether anyone is subscribed, i.e. whether changes need to be recorded.
+  bool active(void) const {
+    return num_subscribers.load(std::memory_order_relaxed) > 0;
+  }
+
+  std::size_t subscribe(std::function<void(const ChangeBatch &)> fn) {
+    std::size_t id;
+    {
+      std::lock_guard<std::mutex> guard(subscribers_mutex);
+      id = next_id++;
+      subscribers.emplace_back(id, std::move(fn));
+      num_subscribers.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> guard(queue_mutex);
+    if (!thread.joinable()) {
+      thread = std::thread([this] { run(); });
+    }
+    return id;
+  }
+
+  void unsubscribe(std::size_t id) {
+    std::lock_guard<std::mutex> guard(subscribers_mutex);
+    auto it = std::find_if(subscribers.begin(), subscribers.end(),
+                           [id] (const auto &subscriber) {
+                             return subscriber.first == id;
+                           });
+    if (it != subscribers.end()) {
+      subscribers.erase(it);
+      num_subscribers.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+
+  void publish(ChangeBatch &&batch) {
+    {
+      std::lock_guard<std::mutex> guard(queue_mutex);
+      queue.push_back(std::move(batch));
+    }
+    queue_cv.notify_one();
+  }
+
+  // Block until every batch published so far has been delivered.
+  void wait_idle(void) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    idle_cv.wait(lock, [this] { return queue.empty() && !delivering; });
+  }
+
+ private:
+  void run(void) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    for (;;) {
+      queue_cv.wait(lock, [this] { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      ChangeBatch batch = std::move(queue.front());
+      queue.pop_front();
+      delivering = true;
+      lock.unlock();
+      {
+        std::lock_guard<std::mutex> guard(subscribers_mutex);
+        for (auto &subscriber : subscribers) {
+          try {
+            subscriber.second(batch);
+          } catch (...) {
+            // There's no one to report a subscriber's failure to.
+          }
+        }
+      }
+      lock.lock();
+      delivering = false;
+      if (queue.empty()) {
+        idle_cv.notify_all();
+      }
+    }
+  }
+
+  std::atomic<std::size_t> num_subscribers{0};
+  std::mutex subscribers_mutex;
+  std::vector<std::pair<std::size_t, std::function<void(const ChangeBatch &)>>>
+    subscribers;
+  std::size_t next_id = 0;
+
+  std::mutex queue_mutex;
+  std::condition_variable queue_cv;
+  std::condition_variable idle_cv;
+  std::deque<ChangeBatch> queue;
+  bool delivering = false;
+  bool stopping = false;
+  std::thread thread;
+};
+
+// Append STR as a JSON string to OUT, which is an std::string or a
+// `RowWriter`.
+template <typename Out>
+inline void append_json_string(Out &out, std::string_view str) {
+  static const char hex_digits[] = "0123456789abcdef";
+  out.push_back('"');
+  std::size_t start = 0;
+  for (std::size_t i = 0; i < str.size(); i++) {
+    auto c = static_cast<unsigned char>(str[i]);
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      continue;
+    }
+    out.append(str.substr(start, i - start));
+    start = i + 1;
+    out.push_back('\\');
+    switch (c) {
+      case '"': out.push_back('"'); break;
+      case '\\': out.push_back('\\'); break;
+      case '\n': out.push_back('n'); break;
+      case '\r': out.push_back('r'); break;
+      case '\t': out.push_back('t'); break;
+      default:
+        out.append("u00");
+        out.push_back(hex_digits[c >> 4]);
+        out.push_back(hex_digits[c & 0xf]);
+    }
+  }
+  out.append(str.substr(start));
+  out.push_back('"');
+}
+
+// A `RowWriter` formats rows as CSV or NDJSON text straight into a buffer of
+// its own, which is written out to an std::ostream whenever it fills up.
+class RowWriter {
+ public:
+  explicit RowWriter(std::ostream &out_)
+    : out(out_), buffer(std::make_unique<char[]>(buffer_size)) { }
+
+  RowWriter(const RowWriter &) = delete;
+  RowWriter &operator=(const RowWriter &) = delete;
+
+  ~RowWriter(void) {
+    flush();
+  }
+
+  void push_back(char c) {
+    if (len == buffer_size) {
+      flush();
+    }
+    buffer[len++] = c;
+  }
+
+  void append(std::string_view str) {
+    if (str.size() > buffer_size - len) {
+      flush();
+      if (str.size() >= buffer_size) {
+        out.write(str.data(), static_cast<std::streamsize>(str.size()));
+        return;
+      }
+    }
+    std::memcpy(buffer.get() + len, str.data(), str.size());
+    len += str.size();
+  }
+
+  void number(sqlite3_int64 value) {
+    char digits[32];
+    auto result = std::to_chars(digits, digits + sizeof(digits), value);
+    append(std::string_view(digits, result.ptr - digits));
+  }
+
+  // Floating-point std::to_chars() needs a newer standard library than the
+  // rest of this file, so use the shortest of 15 or 17 digits that reads
+  // back as the same value, like SQLite's quote() does.
+  void number(double value) {
+    char digits[32];
+    int n = std::snprintf(digits, sizeof(digits), "%.15g", value);
+    if (std::isfinite(value) && std::strtod(digits, nullptr) != value) {
+      n = std::snprintf(digits, sizeof(digits), "%.17g", value);
+    }
+    append(std::string_view(digits, static_cast<size_t>(n)));
+  }
+
+  // Write STR as a CSV field, quoting it if need be.  Empty strings are
+  // quoted to tell them apart from NULLs.
+  void csv_text(std::string_view str) {
+    if (!str.empty() &&
+        str.find_first_of(",\"\r\n") == std::string_view::npos) {
+      append(str);
+      return;
+    }
+    push_back('"');
+    for (std::size_t quote; (quote = str.find('"')) != std::string_view::npos; ) {
+      append(str.substr(0, quote + 1));
+      push_back('"');
+      str.remove_prefix(quote + 1);
+    }
+    append(str);
+    push_back('"');
+  }
+
+  // Write STR as a JSON string.
+  void json_string(std::string_view str) {
+    append_json_string(*this, str);
+  }
+
+  void hex(std::string_view bytes) {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (char byte : bytes) {
+      push_back(hex_digits[static_cast<unsigned char>(byte) >> 4]);
+      push_back(hex_digits[static_cast<unsigned char>(byte) & 0xf]);
+    }
+  }
+
+  void flush(void) {
+    out.write(buffer.get(), static_cast<std::streamsize>(len));
+    len = 0;
+  }
+
+ private:
+  static constexpr std::size_t buffer_size = 64 * 1024;
+
+  std::ostream &out;
+  std::unique_ptr<char[]> buffer;
+  std::size_t len = 0;
+};
+
+// Write column IDX of the current row of STMT to WRITER, as a CSV field if
+// JSON is false and as a JSON value otherwise.  BLOBs are written as
+// hexadecimal text.
+inline void write_column(RowWriter &writer, sqlite3_stmt *stmt, int idx,
+                         bool json) {
+  switch (sqlite3_column_type(stmt, idx)) {
+    case SQLITE_INTEGER:
+      writer.number(sqlite3_column_int64(stmt, idx));
+      break;
+    case SQLITE_FLOAT: {
+      double value = sqlite3_column_double(stmt, idx);
+      if (json && !std::isfinite(value)) {
+        writer.append("null");
+      } else {
+        writer.number(value);
+      }
+      break;
+    }
+    case SQLITE_TEXT: {
+      auto ptr = (const char *)sqlite3_column_text(stmt, idx);
+      std::string_view text(ptr, sqlite3_column_bytes(stmt, idx));
+      if (json) {
+        writer.json_string(text);
+      } else {
+        writer.csv_text(text);
+      }
+      break;
+    }
+    case SQLITE_BLOB: {
+      auto ptr = (const char *)sqlite3_column_blob(stmt, idx);
+      std::string_view bytes(ptr, sqlite3_column_bytes(stmt, idx));
+      if (json) {
+        writer.push_back('"');
+        writer.hex(bytes);
+        writer.push_back('"');
+      } else {
+        writer.hex(bytes);
+      }
+      break;
+    }
+    default:
+      if (json) {
+        writer.append("null");
+      }
+      break;
+  }
+}
+
+// A value parsed from an import chunk, to be bound to a statement parameter.
+// Text lives in the `storage` of the chunk it was parsed from; so does the
+// key naming the parameter, for NDJSON input.
+struct ImportField {
+  enum Kind : unsigned char { null_value, text, integer, real };
+  Kind kind = null_value;
+  std::size_t key_offset = 0, key_len = 0;
+  std::size_t text_offset = 0, text_len = 0;
+  sqlite3_int64 integer_value = 0;
+  double real_value = 0;
+};
+
+// The records parsed from one chunk of import input.  Record i consists of
+// fields[record_ends[i - 1]] up to fields[record_ends[i]].
+struct ImportChunk {
+  std::string storage;
+  std::vector<ImportField> fields;
+  std::vector<std::size_t> record_ends;
+};
+
+// Parse the CSV records in INPUT.  If SKIP_FIRST is true, the first record
+// (a header line) is dropped.
+inline ImportChunk parse_csv_chunk(std::string_view input, bool skip_first,
+                                   bool empty_as_null) {
+  ImportChunk chunk;
+  chunk.storage.reserve(input.size());
+  std::size_t pos = 0;
+  bool skip_record = skip_first;
+  while (pos < input.size()) {
+    // Parse one record.  A blank line is a record of one empty field, as a
+    // one-column export writes NULLs.
+    for (;;) {
+      ImportField field;
+      field.kind = ImportField::text;
+      field.text_offset = chunk.storage.size();
+      bool quoted = pos < input.size() && input[pos] == '"';
+      if (quoted) {
+        pos++;
+        for (;;) {
+          auto quote = input.find('"', pos);
+          if (quote == std::string_view::npos) {
+            throw error{SQLITE_FORMAT};
+          }
+          chunk.storage.append(input.substr(pos, quote - pos));
+          pos = quote + 1;
+          if (pos < input.size() && input[pos] == '"') {
+            chunk.storage.push_back('"');
+            pos++;
+          } else {
+            break;
+          }
+        }
+      } else {
+        auto end = input.find_first_of(",\n", pos);
+        if (end == std::string_view::npos) {
+          end = input.size();
+        }
+        auto value = input.substr(pos, end - pos);
+        if (!value.empty() && value.back() == '\r') {
+          value.remove_suffix(1);
+        }
+        chunk.storage.append(value);
+        pos = end;
+      }
+      field.text_len = chunk.storage.size() - field.text_offset;
+      if (!quoted && field.text_len == 0 && empty_as_null) {
+        field.kind = ImportField::null_value;
+      }
+      if (!skip_record) {
+        chunk.fields.push_back(field);
+      }
+      if (pos < input.size() && input[pos] == '\r') {
+        pos++;
+      }
+      if (pos < input.size() && input[pos] == ',') {
+        pos++;
+        continue;
+      }
+      if (pos < input.size() && input[pos] != '\n') {
+        throw error{SQLITE_FORMAT};
+      }
+      pos++;
+      break;
+    }
+    if (!skip_record) {
+      chunk.record_ends.push_back(chunk.fields.size());
+    }
+    skip_record = false;
+  }
+  return chunk;
+}
+
+// A parser for NDJSON lines, each holding one JSON object whose members are
+// bound to the statement parameters of the same name.  Nested objects and
+// arrays are kept as JSON text.
+class NdjsonParser {
+ public:
+  NdjsonParser(std::string_view input_, ImportChunk &chunk_)
+    : input(input_), chunk(chunk_) { }
+
+  void parse(void) {
+    chunk.storage.reserve(input.size());
+    while (pos < input.size()) {
+      skip_whitespace();
+      if (pos == input.size()) {
+        break;
+      }
+      if (input[pos] == '\n') {
+        pos++;
+        continue;
+      }
+      parse_object();
+      skip_whitespace();
+      if (pos < input.size()) {
+        expect('\n');
+      }
+      chunk.record_ends.push_back(chunk.fields.size());
+    }
+  }
+
+ private:
+  void parse_object(void) {
+    expect('{');
+    skip_whitespace();
+    if (peek() == '}') {
+      pos++;
+      return;
+    }
+    for (;;) {
+      skip_whitespace();
+      ImportField field;
+      field.key_offset = chunk.storage.size();
+      expect('"');
+      parse_string_body();
+      field.key_len = chunk.storage.size() - field.key_offset;
+      skip_whitespace();
+      expect(':');
+      skip_whitespace();
+      parse_value(field);
+      chunk.fields.push_back(field);
+      skip_whitespace();
+      if (peek() == ',') {
+        pos++;
+        continue;
+      }
+      expect('}');
+      return;
+    }
+  }
+
+  void parse_value(ImportField &field) {
+    char c = peek();
+    if (c == '"') {
+      pos++;
+      field.kind = ImportField::text;
+      field.text_offset = chunk.storage.size();
+      parse_string_body();
+      field.text_len = chunk.storage.size() - field.text_offset;
+    } else if (c == '{' || c == '[') {
+      auto start = pos;
+      skip_nested();
+      field.kind = ImportField::text;
+      field.text_offset = chunk.storage.size();
+      chunk.storage.append(input.substr(start, pos - start));
+      field.text_len = pos - start;
+    } else if (consume("null")) {
+      field.kind = ImportField::null_value;
+    } else if (consume("true")) {
+      field.kind = ImportField::integer;
+      field.integer_value = 1;
+    } else if (consume("false")) {
+      field.kind = ImportField::integer;
+      field.integer_value = 0;
+    } else {
+      auto end = input.find_first_not_of("+-0123456789.eE", pos);
+      if (end == std::string_view::npos) {
+        end = input.size();
+      }
+      auto number = input.substr(pos, end - pos);
+      const char *first = number.data(), *last = first + number.size();
+      bool ok;
+      if (number.find_first_of(".eE") == std::string_view::npos) {
+        field.kind = ImportField::integer;
+        auto result = std::from_chars(first, last, field.integer_value);
+        ok = result.ec == std::errc() && result.ptr == last;
+      } else {
+        // strtod() rather than floating-point std::from_chars(), for the
+        // same reason as in RowWriter::number().
+        field.kind = ImportField::real;
+        std::string copy(number);
+        char *parsed;
+        field.real_value = std::strtod(copy.c_str(), &parsed);
+        ok = parsed == copy.c_str() + copy.size() &&
+             std::isfinite(field.real_value);
+      }
+      if (number.empty() || !ok) {
+        throw error{SQLITE_FORMAT};
+      }
+      pos = end;
+    }
+  }
+
+  // Parse the rest of a string whose opening quote has been consumed,
+  // appending its unescaped contents to the chunk's storage.
+  void parse_string_body(void) {
+    for (;;) {
+      auto special = input.find_first_of("\"\\\n", pos);
+      if (special == std::string_view::npos || input[special] == '\n') {
+        throw error{SQLITE_FORMAT};
+      }
+      chunk.storage.append(input.substr(pos, special - pos));
+      pos = special + 1;
+      if (input[special] == '"') {
+        return;
+      }
+      char escaped = peek();
+      pos++;
+      switch (escaped) {
+        case '"': case '\\': case '/': chunk.storage.push_back(escaped); break;
+        case 'b': chunk.storage.push_back('\b'); break;
+        case 'f': chunk.storage.push_back('\f'); break;
+        case 'n': chunk.storage.push_back('\n'); break;
+        case 'r': chunk.storage.push_back('\r'); break;
+        case 't': chunk.storage.push_back('\t'); break;
+        case 'u': append_utf8(parse_code_point()); break;
+        default: throw error{SQLITE_FORMAT};
+      }
+    }
+  }
+
+  std::uint32_t parse_hex4(void) {
+    if (pos + 4 > input.size()) {
+      throw error{SQLITE_FORMAT};
+    }
+    std::uint32_t value = 0;
+    auto result = std::from_chars(input.data() + pos, input.data() + pos + 4,
+                                  value, 16);
+    if (result.ptr != input.data() + pos + 4) {
+      throw error{SQLITE_FORMAT};
+    }
+    pos += 4;
+    return value;
+  }
+
+  std::uint32_t parse_code_point(void) {
+    std::uint32_t code_point = parse_hex4();
+    if (code_point >= 0xd800 && code_point < 0xdc00 &&
+        input.substr(pos, 2) == "\\u") {
+      pos += 2;
+      std::uint32_t low = parse_hex4();
+      if (low < 0xdc00 || low >= 0xe000) {
+        throw error{SQLITE_FORMAT};
+      }
+      code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+    }
+    return code_point;
+  }
+
+  void append_utf8(std::uint32_t code_point) {
+    auto &out = chunk.storage;
+    if (code_point < 0x80) {
+      out.push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      out.push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+      out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else if (code_point < 0x10000) {
+      out.push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+      out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+      out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else {
+      out.push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+      out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+      out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+      out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+  }
+
+  // Skip over a nested object or array, strings within it included.
+  void skip_nested(void) {
+    int depth = 0;
+    do {
+      auto special = input.find_first_of("{}[]\"\n", pos);
+      if (special == std::string_view::npos || input[special] == '\n') {
+        throw error{SQLITE_FORMAT};
+      }
+      pos = special + 1;
+      switch (input[special]) {
+        case '{': case '[': depth++; break;
+        case '}': case ']': depth--; break;
+        default:
+          // Skip the string, escaped quotes included.
+          for (;;) {
+            auto quote = input.find_first_of("\"\\", pos);
+            if (quote == std::string_view::npos) {
+              throw error{SQLITE_FORMAT};
+            }
+            pos = quote + 1 + (input[quote] == '\\');
+            if (input[quote] == '"') {
+              break;
+            }
+          }
+      }
+    } while (depth > 0);
+  }
+
+  void skip_whitespace(void) {
+    while (pos < input.size() &&
+           (input[pos] == ' ' || input[pos] == '\t' || input[pos] == '\r')) {
+      pos++;
+    }
+  }
+
+  char peek(void) const {
+    if (pos >= input.size()) {
+      throw error{SQLITE_FORMAT};
+    }
+    return input[pos];
+  }
+
+  void expect(char c) {
+    if (peek() != c) {
+      throw error{SQLITE_FORMAT};
+    }
+    pos++;
+  }
+
+  bool consume(std::string_view word) {
+    if (input.substr(pos, word.size()) == word) {
+      pos += word.size();
+      return true;
+    }
+    return false;
+  }
+
+  std::string_view input;
+  ImportChunk &chunk;
+  std::size_t pos = 0;
+};
+
+// A bounded, closable multi-producer multi-consumer queue, used to pass work
+// between the stages of an import.
+template <typename T>
+class BlockingQueue {
+ public:
+  explicit BlockingQueue(std::size_t capacity_) : capacity(capacity_) { }
+
+  // Returns false if the queue has been closed.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(item));
+    not_empty.notify_one();
+    return true;
+  }
+
+  // Returns std::nullopt once the queue is closed and empty.
+  std::optional<T> pop(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty()) {
+      return std::nullopt;
+    }
+    T item = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return item;
+  }
+
+  void close(void) {
+    std::lock_guard<std::mutex> guard(mutex);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+ private:
+  const std::size_t capacity;
+  std::mutex mutex;
+  std::condition_variable not_empty, not_full;
+  std::deque<T> items;
+  bool closed = false;
+};
+
 } // namespace detail
 
+// Configure how SQLite allocates memory.  This must be called before the
+// first connection to any database is made; afterwards it throws an `error`
+// with code SQLITE_MISUSE.
+inline void configureMemory(const MemoryOptions &options) {
+  std::lock_guard<std::mutex> guard(detail::sqlite3_config_mutex);
+  if (detail::sqlite3_configured) {
+    throw error{SQLITE_MISUSE};
+  }
+  detail::memory_options = options;
+}
+
+// Configure how the messages SQLite logs are reported.  This may be called at
+// any time.
+inline void configureLogging(const LogOptions &options) {
+  detail::log_ring.configure(options);
+}
+
+// Block until every message SQLite has logged so far has been reported.
+inline void flushLog(void) {
+  detail::log_ring.flush();
+}
+
+// Return the current allocation statistics of the thread-local pools.
+inline MemoryStats memoryStats(void) {
+  std::lock_guard<std::mutex> guard(detail::pool::registry_mutex);
+  MemoryStats total = detail::pool::retired_stats;
+  for (auto *pool : detail::pool::registry) {
+    pool->stats.accumulate_into(total);
+  }
+  return total;
+}
+
 // Marshal the function `fn` to an equivalent SQL function named `fn_name`.
 
 template <const char *fn_name, typename T>
@@ -269,17 +1946,103 @@ template <const auto &db_name>
 class Database {
  public:
   // This hook is called every time a connection is made, taking as argument
-  // the database handle corresponding to the new connection.
+  // the database handle corresponding to the new connection.  It runs after
+  // the wrapper installs its own update, commit and rollback hooks, so it may
+  // replace them, in which case the connection's changes no longer reach
+  // subscribers (see `subscribe()`).
   static inline std::function<void(sqlite3 *)> post_connection_hook;
 
- private:
-  struct Connection {
-    sqlite3 *db_handle;
+  // When set before the first connection is made, connections are opened in
+  // SQLite's serialized threading mode (SQLITE_OPEN_FULLMUTEX).  This makes it
+  // safe to step through a `QueryResult` on another thread while the thread
+  // that created it keeps issuing queries, at the cost of a mutex acquisition
+  // inside every SQLite call on that connection.
+  static inline bool serialized_connections = false;
+
+  // When set before connections are made, the database is opened as an
+  // immutable, read-only snapshot (a URI filename with `immutable=1`), for
+  // databases which are built offline and then only read.  SQLite then takes
+  // no file locks and never checks whether the file has changed, and
+  // connections memory-map the whole file unless `mmap_size` says otherwise.
+  // The file must really not change while it is open.
+  static inline bool immutable = false;
+
+  // When nonzero, the number of bytes of the database file each connection
+  // memory-maps (`pragma mmap_size`).
+  static inline sqlite3_int64 mmap_size = 0;
+
+  // How the page caches of connections to this database are bounded.  This
+  // applies to connections opened after it is set.
+  static inline MemoryBudget memory_budget;
+
+  // When set, this hook is called with the `EXPLAIN QUERY PLAN` output of each
+  // query the first time that query is prepared, e.g. to catch full table
+  // scans caused by missing indexes.
+  static inline std::function<void(const QueryPlan &)> query_plan_hook;
+
+  // When set before a connection is made, this hook is called for every
+  // statement run on that connection which takes at least
+  // `slow_query_threshold` to complete, with the statement's SQL (bound
+  // parameters expanded) and the time it took.
+  static inline std::function<void(std::string_view, std::chrono::nanoseconds)>
+    slow_query_hook;
+  static inline std::chrono::nanoseconds slow_query_threshold
+    = std::chrono::milliseconds(100);
+
+ public:
+  class QueryResult;
+
+  // A `Connection` is a connection to the database at `db_name`, along with
+  // the prepared statements cached on it.
+  //
+  // Each thread implicitly gets a connection of its own, which is the one used
+  // by the static `query()` and transaction functions.  It is opened on first
+  // use and closed when the thread exits, unless `connect()` and
+  // `disconnect()` are used to open and close it earlier.
+  //
+  // Connections can also be created explicitly, e.g. to be kept in a pool.
+  // A `Connection` object itself, whether implicit or explicit, must only be
+  // used by one thread at a time, since its statement caches aren't locked.
+  // `serialized_connections` only makes it safe to step through QueryResults
+  // obtained from it on other threads meanwhile.
+  //
+  // A closed connection is reopened the next time a query is run on it.
+  class Connection {
+   public:
+    // Open an explicit connection.
+    Connection(void) {
+      open();
+    }
+
+    Connection(Connection &&other) {
+      *this = std::move(other);
+    }
+
+    Connection &operator=(Connection &&other) {
+      if (this != &other) {
+        std::swap(db_handle, other.db_handle);
+        std::swap(owner, other.owner);
+        std::swap(serialized, other.serialized);
+        std::swap(homes, other.homes);
+        std::swap(returns_pending, other.returns_pending);
+        std::swap(pending_changes, other.pending_changes);
+      }
+      return *this;
+    }
 
     Connection(const Connection &) = delete;
     Connection &operator=(const Connection &) = delete;
 
-    Connection(void) {
+    ~Connection(void) {
+      close();
+    }
+
+    // Open the connection, if it isn't open already.
+    void open(void) {
+      if (db_handle != nullptr) {
+        return;
+      }
+
       // Since each thread has its own exclusive connection to the database, we
       // can safely set SQLITE_CONFIG_MULTITHREAD so that SQLite may assume
       // the database will not be accessed from the same connection by two
@@ -290,24 +2053,118 @@ class Database {
           sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
           sqlite3_config(SQLITE_CONFIG_LOG,
                          detail::sqlite_error_log_callback, nullptr);
+          if (detail::memory_options.thread_local_pools) {
+            sqlite3_config(SQLITE_CONFIG_MALLOC, &detail::pool::mem_methods);
+          }
+          sqlite3_config(SQLITE_CONFIG_MEMSTATUS,
+                         static_cast<int>(detail::memory_options.memstatus));
           detail::sqlite3_configured = true;
         }
       } while (0);
       static const auto saved_db_name = detail::maybe_invoke(db_name);
-      auto ret = sqlite3_open(&saved_db_name[0], &db_handle);
+      serialized = serialized_connections;
+      std::string immutable_uri;
+      const char *path = &saved_db_name[0];
+      int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+      if (immutable) {
+        immutable_uri = detail::immutable_uri(path);
+        path = immutable_uri.c_str();
+        flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_URI;
+      }
+      if (serialized) {
+        flags |= SQLITE_OPEN_FULLMUTEX;
+      }
+      if (memory_budget.shared_cache) {
+        flags |= SQLITE_OPEN_SHAREDCACHE;
+      }
+      auto ret = sqlite3_open_v2(path, &db_handle, flags, nullptr);
       if (ret != SQLITE_OK) {
-        throw error{ret};
+        error e(ret, db_handle);
+        sqlite3_close_v2(std::exchange(db_handle, nullptr));
+        throw e;
+      }
+
+      if (detail::memory_options.lookaside_slot_size > 0 &&
+          detail::memory_options.lookaside_slot_count > 0) {
+        sqlite3_db_config(db_handle, SQLITE_DBCONFIG_LOOKASIDE, nullptr,
+                          detail::memory_options.lookaside_slot_size,
+                          detail::memory_options.lookaside_slot_count);
+      }
+
+      if (memory_budget.cache_size_kib > 0) {
+        std::string cache_size_pragma = "pragma cache_size = -";
+        cache_size_pragma.append(std::to_string(memory_budget.cache_size_kib));
+        sqlite3_exec(db_handle, cache_size_pragma.c_str(),
+                     nullptr, nullptr, nullptr);
+      }
+      if (memory_budget.soft_heap_limit > 0) {
+        sqlite3_soft_heap_limit64(memory_budget.soft_heap_limit);
+      }
+
+      if (immutable || mmap_size > 0) {
+        std::string mmap_pragma = "pragma mmap_size = ";
+        // SQLite clamps this to the largest size it was built to support.
+        mmap_pragma.append(std::to_string(
+            mmap_size > 0 ? mmap_size
+                          : std::numeric_limits<sqlite3_int64>::max()));
+        sqlite3_exec(db_handle, mmap_pragma.c_str(), nullptr, nullptr, nullptr);
       }
 
       // When the database has been temporarily locked by another process, this
       // tells SQLite to retry the command/query until it succeeds, rather than
-      // returning SQLITE_BUSY immediately.
-      sqlite3_busy_handler(db_handle,
-          [](void *, int) {
-            std::this_thread::yield();
-            return 1;
+      // returning SQLITE_BUSY immediately.  An immutable database is never
+      // locked.
+      if (!immutable) {
+        sqlite3_busy_handler(db_handle,
+            [](void *, int) {
+              std::this_thread::yield();
+              return 1;
+            },
+            nullptr);
+      }
+
+      if (slow_query_hook) {
+        sqlite3_trace_v2(db_handle, SQLITE_TRACE_PROFILE,
+            [] (unsigned, void *, void *stmt, void *elapsed) {
+              std::chrono::nanoseconds elapsed_ns(
+                  *static_cast<sqlite3_int64 *>(elapsed));
+              if (slow_query_hook && elapsed_ns >= slow_query_threshold) {
+                char *sql = sqlite3_expanded_sql(
+                    static_cast<sqlite3_stmt *>(stmt));
+                slow_query_hook(sql ? sql : "", elapsed_ns);
+                sqlite3_free(sql);
+              }
+              return 0;
+            },
+            nullptr);
+      }
+
+      // Record row changes as they are made, and hand them over to the change
+      // dispatcher only once their transaction commits.
+      sqlite3_update_hook(db_handle,
+          [] (void *pending, int operation, const char *database,
+              const char *table, sqlite3_int64 rowid) {
+            if (change_dispatcher.active()) {
+              static_cast<ChangeBatch *>(pending)->push_back(
+                  {operation, database, table, rowid});
+            }
+          },
+          pending_changes.get());
+      sqlite3_commit_hook(db_handle,
+          [] (void *pending) {
+            auto *batch = static_cast<ChangeBatch *>(pending);
+            if (!batch->empty()) {
+              change_dispatcher.publish(std::move(*batch));
+              batch->clear();
+            }
+            return 0;
           },
-          nullptr);
+          pending_changes.get());
+      sqlite3_rollback_hook(db_handle,
+          [] (void *pending) {
+            static_cast<ChangeBatch *>(pending)->clear();
+          },
+          pending_changes.get());
 
       if (post_connection_hook) {
         post_connection_hook(db_handle);
@@ -318,154 +2175,306 @@ class Database {
       }
     }
 
-    ~Connection(void) {
+    // Finalize the statements cached on the connection and close it.
+    // Statements still held by QueryResults are finalized when those are
+    // destroyed.
+    void close(void) {
+      if (db_handle == nullptr) {
+        return;
+      }
+      for (auto *home : homes) {
+        if (home != nullptr) {
+          home->close();
+        }
+      }
+      homes.clear();
       // To close the database, we use sqlite3_close_v2() because unlike
       // sqlite3_close(), this function allows there to be un-finalized
-      // prepared statements.  The database handle will close once
-      // all prepared statements have been finalized by the thread-local
-      // `PreparedStmtCache` destructors.
-      sqlite3_close_v2(db_handle);
+      // prepared statements.  The database handle will close once the
+      // statements still held by QueryResults have been finalized.
+      sqlite3_close_v2(std::exchange(db_handle, nullptr));
     }
-  };
 
-  // The connection to the database at `db_name` is thread-local.
-  static Connection &connection_tls(void) {
-    static thread_local Connection object;
-    return object;
-  }
+    bool isOpen(void) const {
+      return db_handle != nullptr;
+    }
 
-  // The `PreparedStmtCache` is a cache of available prepared statements for
-  // reuse corresponding to the query given by `query_str`.
-  template <const auto &query_str>
-  class PreparedStmtCache {
-   public:
-    static inline void put_tls(sqlite3_stmt *stmt) {
-      singleton_tls().internal_put(stmt);
+    // The underlying SQLite database handle, or nullptr if the connection is
+    // closed.
+    sqlite3 *handle(void) const {
+      return db_handle;
     }
 
-    static inline sqlite3_stmt *get_tls(void) {
-      return singleton_tls().internal_get();
+    // The page cache statistics of this connection.  If RESET is true, the
+    // hit, miss and write counters are reset afterwards.
+    CacheStats cacheStats(bool reset = false) const {
+      CacheStats stats;
+      if (db_handle == nullptr) {
+        return stats;
+      }
+      int highwater;
+      sqlite3_db_status(db_handle, SQLITE_DBSTATUS_CACHE_USED,
+                        &stats.cache_used, &highwater, 0);
+      sqlite3_db_status(db_handle, SQLITE_DBSTATUS_CACHE_USED_SHARED,
+                        &stats.cache_used_shared, &highwater, 0);
+      sqlite3_db_status(db_handle, SQLITE_DBSTATUS_CACHE_HIT,
+                        &stats.cache_hits, &highwater, reset);
+      sqlite3_db_status(db_handle, SQLITE_DBSTATUS_CACHE_MISS,
+                        &stats.cache_misses, &highwater, reset);
+      sqlite3_db_status(db_handle, SQLITE_DBSTATUS_CACHE_WRITE,
+                        &stats.cache_writes, &highwater, reset);
+      return stats;
     }
 
-   private:
-    PreparedStmtCache(void)
-      : db_handle(connection_tls().db_handle),
-        first_free_stmt(nullptr), other_free_stmts() { }
+    // Like `Database::query()`, but on this connection.
+    template <const auto &query_str, typename... Ts>
+    QueryResult query(Ts &&...bind_args) {
+      // If we need to use any user-defined conversion functions, perform the
+      // conversions and recursively call query() with the converted
+      // arguments.
+      if constexpr (((user_serialize_fn<std::decay_t<Ts>> != nullptr) || ...)) {
+        auto maybe_serialize = [] (auto &&arg) -> decltype(auto) {
+          using arg_t = std::decay_t<decltype(arg)>;
+          if constexpr (user_serialize_fn<arg_t> != nullptr) {
+            return user_serialize_fn<arg_t>(std::forward<decltype(arg)>(arg));
+          } else {
+            return std::forward<decltype(arg)>(arg);
+          }
+        };
+        return query<query_str>(
+            maybe_serialize(std::forward<Ts>(bind_args))...);
+      } else {
+        open();
+
+        detail::StmtHome *home;
+        sqlite3_stmt *stmt = PreparedStmtCache<query_str>::get(*this, home);
 
-    ~PreparedStmtCache(void) {
-      sqlite3_finalize(first_free_stmt);
-      for (auto stmt : other_free_stmts) {
-        sqlite3_finalize(stmt);
+        bind_args_to(stmt, std::index_sequence_for<Ts...>(), bind_args...);
+
+        return QueryResult(stmt, home);
       }
     }
 
-    static PreparedStmtCache<query_str> &singleton_tls() {
-      static thread_local PreparedStmtCache<query_str> object;
-      return object;
+    // Prepare a statement for each of QUERY_STRS and cache it on the
+    // connection, so that the first run of each query doesn't pay for it.
+    template <const auto &...query_strs>
+    void prepare(void) {
+      open();
+      auto prepare_one = [this] (auto get) {
+        detail::StmtHome *home;
+        sqlite3_stmt *stmt = get(*this, home);
+        home->put(stmt);
+      };
+      (prepare_one(&PreparedStmtCache<query_strs>::get), ...);
+    }
+
+   private:
+    struct implicit_tag { };
+
+    template <std::size_t... idxs, typename... Ts>
+    static void bind_args_to([[maybe_unused]] sqlite3_stmt *stmt,
+                             std::index_sequence<idxs...>,
+                             const Ts &...args) {
+      (bind_arg<static_cast<int>(idxs) + 1>(stmt, args), ...);
     }
 
-    sqlite3_stmt *internal_get(void) {
-      if (first_free_stmt != nullptr) {
-        sqlite3_stmt *stmt = nullptr;
-        std::swap(first_free_stmt, stmt);
-        return stmt;
-      } else if (!other_free_stmts.empty()) {
-        sqlite3_stmt *stmt = other_free_stmts.back();
-        other_free_stmts.pop_back();
-        return stmt;
+    // Bind ARG to the parameter ?IDX of STMT, using the SQLite C API function
+    // matching ARG's type.  IDX being a template argument, each query()
+    // invocation compiles down to a straight sequence of sqlite3_bind_* calls.
+    template <int idx, typename T>
+    static void bind_arg(sqlite3_stmt *stmt, const T &arg) {
+      if constexpr (std::is_integral_v<T>) {
+        sqlite3_bind_int64(stmt, idx, arg);
+      } else if constexpr (std::is_same_v<const char *, T> ||
+                           std::is_same_v<char *, T>) {
+        sqlite3_bind_text(stmt, idx, arg, strlen(arg), SQLITE_STATIC);
+      } else if constexpr (std::is_array_v<T>) {
+        bind_arg<idx>(stmt, static_cast<const char *>(arg));
+      } else if constexpr (std::is_same_v<std::string, T>) {
+        sqlite3_bind_text(stmt, idx, &arg[0], arg.size(), SQLITE_STATIC);
+      } else if constexpr (std::is_same_v<blob, T> ||
+                           std::is_same_v<blob_view, T>) {
+        sqlite3_bind_blob(stmt, idx, &arg[0], arg.size(), SQLITE_STATIC);
+      } else if constexpr (std::is_same_v<std::nullopt_t, T>) {
+        sqlite3_bind_null(stmt, idx);
+      } else if constexpr (detail::is_std_optional_type<T>) {
+        if (arg) {
+          bind_arg<idx>(stmt, *arg);
+        } else {
+          sqlite3_bind_null(stmt, idx);
+        }
       } else {
+        static_assert(detail::dependent_false<T>);
+      }
+    }
+
+    // Reset the statements given back to this connection from other threads.
+    void reclaim_returned_stmts(void) {
+      if (returns_pending->load(std::memory_order_relaxed) &&
+          returns_pending->exchange(false, std::memory_order_acquire)) {
+        for (auto *home : homes) {
+          if (home != nullptr) {
+            home->reclaim();
+          }
+        }
+      }
+    }
+
+    // The calling thread's implicit connection, opened on first use.
+    explicit Connection(implicit_tag) : owner(std::this_thread::get_id()) { }
+
+    detail::StmtHome *home(std::size_t slot) {
+      if (slot >= homes.size()) {
+        homes.resize(slot + 1, nullptr);
+      }
+      if (homes[slot] == nullptr) {
+        homes[slot] = new detail::StmtHome(owner, serialized, returns_pending);
+      }
+      return homes[slot];
+    }
+
+    sqlite3 *db_handle = nullptr;
+    // The thread owning an implicit connection, or no thread for an explicit
+    // one.
+    std::thread::id owner;
+    bool serialized = false;
+    // The statement caches of this connection, indexed by query.
+    std::vector<detail::StmtHome *> homes;
+    // Whether any of `homes` has statements given back from another thread.
+    std::shared_ptr<std::atomic<bool>> returns_pending
+      = std::make_shared<std::atomic<bool>>(false);
+    // The row changes made by the current transaction.  This lives on the heap
+    // so that its address, which SQLite's hooks hold on to, survives moves.
+    std::unique_ptr<ChangeBatch> pending_changes
+      = std::make_unique<ChangeBatch>();
+
+    friend class Database<db_name>;
+  };
+
+  // Open the calling thread's implicit connection, if it isn't open already.
+  // Thread pools may call this when a worker starts so that its first query
+  // doesn't pay for opening the database and loading its schema.
+  static void connect(void) {
+    connection_tls();
+  }
+
+  // Close the calling thread's implicit connection, e.g. when a worker goes
+  // idle, releasing its file descriptors and page cache.  It is reopened on
+  // the next query.
+  static void disconnect(void) {
+    thread_connection().close();
+  }
+
+  // Whether the calling thread's implicit connection is open.
+  static bool isConnected(void) {
+    return thread_connection().isOpen();
+  }
+
+  // Subscribe FN to the row changes made to the database through any of this
+  // process's connections to it, whichever thread they belong to.  FN is
+  // called on a background thread with the changes made by each transaction
+  // as it commits, in commit order.  Returns an identifier to pass to
+  // `unsubscribe()`.
+  //
+  // Changes are those reported by sqlite3_update_hook: changes to WITHOUT
+  // ROWID tables, and rows removed by the truncate optimization of an
+  // unconditional DELETE, are not reported, and changes undone by
+  // `ROLLBACK TO` a savepoint are reported anyway.  Changes are only recorded
+  // while there are subscribers.  Exceptions thrown by FN are ignored.
+  static std::size_t subscribe(std::function<void(const ChangeBatch &)> fn) {
+    return change_dispatcher.subscribe(std::move(fn));
+  }
+
+  // Cancel a subscription.  Once this returns, the subscriber is no longer
+  // called.  This must not be called from within a subscriber.
+  static void unsubscribe(std::size_t id) {
+    change_dispatcher.unsubscribe(id);
+  }
+
+  // Block until the changes of every transaction committed so far have been
+  // delivered to the subscribers.
+  static void waitForChanges(void) {
+    change_dispatcher.wait_idle();
+  }
+
+  // The page cache statistics of the calling thread's implicit connection.
+  static CacheStats cacheStats(bool reset = false) {
+    return thread_connection().cacheStats(reset);
+  }
+
+  // Prepare and cache statements for QUERY_STRS on the calling thread's
+  // implicit connection.
+  template <const auto &...query_strs>
+  static void prepare(void) {
+    connection_tls().template prepare<query_strs...>();
+  }
+
+ private:
+  static inline detail::ChangeDispatcher change_dispatcher;
+
+  // The calling thread's implicit connection, which may be closed.
+  static Connection &thread_connection(void) {
+    static thread_local Connection object{typename Connection::implicit_tag{}};
+    return object;
+  }
+
+  // The calling thread's implicit connection, opened if need be.
+  static Connection &connection_tls(void) {
+    Connection &object = thread_connection();
+    object.open();
+    return object;
+  }
+
+  // The `PreparedStmtCache` hands out prepared statements for the query given
+  // by `query_str`, reusing ones cached on the connection when possible.
+  template <const auto &query_str>
+  class PreparedStmtCache {
+   public:
+    // Take a statement for the query from the cache of CONN, or prepare a new
+    // one if none is available.  HOME is set to where the statement must be
+    // given back to.
+    static sqlite3_stmt *get(Connection &conn, detail::StmtHome *&home) {
+      static const std::size_t slot = detail::next_stmt_slot++;
+      conn.reclaim_returned_stmts();
+      home = conn.home(slot);
+      sqlite3_stmt *stmt = home->take();
+      if (stmt == nullptr) {
         static const auto saved_query_str = detail::maybe_invoke(query_str);
         // If no prepared statement is available for reuse, make a new one.
-        sqlite3_stmt *stmt;
         std::string_view query_str_view = saved_query_str;
-        auto ret = sqlite3_prepare_v3(db_handle,
+        auto ret = sqlite3_prepare_v3(conn.db_handle,
                                       query_str_view.data(),
                                       query_str_view.length() + 1,
                                       SQLITE_PREPARE_PERSISTENT,
                                       &stmt, nullptr);
         if (ret != SQLITE_OK) {
-          throw error{ret};
+          throw error(ret, conn.db_handle, query_str_view);
+        }
+        home->query = query_str_view;
+        if (query_plan_hook) {
+          static std::once_flag plan_reported;
+          std::call_once(plan_reported, [&conn, query_str_view] {
+            QueryPlan plan;
+            plan.query = query_str_view;
+            detail::explain_query_plan(conn.db_handle, plan);
+            query_plan_hook(plan);
+          });
         }
-        return stmt;
-      }
-    }
-
-    // This is called by the row fetcher returned by query<query_str, ...>().
-    void internal_put(sqlite3_stmt *stmt) {
-      if (first_free_stmt == nullptr) {
-        first_free_stmt = stmt;
-      } else {
-        other_free_stmts.push_back(stmt);
       }
+      home->retain();
+      return stmt;
     }
-
-    sqlite3 *db_handle;
-    sqlite3_stmt *first_free_stmt;
-    std::vector<sqlite3_stmt *> other_free_stmts;
   };
 
  public:
-  class QueryResult;
-
   // Prepare or reuse a statement corresponding to the query string QUERY_STR,
   // binding BIND_ARGS to the parameters ?1, ?2, ..., of the statement.
   // Returns a QueryResult object, with which one can step through the results
   // returned by the query.
   template <const auto &query_str, typename... Ts>
   static QueryResult query(Ts &&...bind_args) {
-    // If we need to use any user-defined conversion functions, perform the
-    // conversions and recursively call query() with the converted arguments.
-    if constexpr (((user_serialize_fn<std::decay_t<Ts>> != nullptr) || ...)) {
-      auto maybe_serialize = [] (auto &&arg) -> decltype(auto) {
-        using arg_t = std::decay_t<decltype(arg)>;
-        if constexpr (user_serialize_fn<arg_t> != nullptr) {
-          return user_serialize_fn<arg_t>(std::forward<decltype(arg)>(arg));
-        } else {
-          return std::forward<decltype(arg)>(arg);
-        }
-      };
-      return query<query_str>(maybe_serialize(std::forward<Ts>(bind_args))...);
-    } else {
-      sqlite3_stmt *stmt = PreparedStmtCache<query_str>::get_tls();
-
-      // Via the fold expression right below, `bind_dispatcher` is called on
-      // each argument passed in to `query()` and binds the argument to the
-      // statement according to the argument's type, using the correct SQL C
-      // API function.
-      int idx = 1;
-      auto bind_dispatcher = [stmt, &idx] (const auto &arg, auto &self) {
-
-        using arg_t = std::decay_t<decltype(arg)>;
-        if constexpr (std::is_integral_v<arg_t>) {
-          sqlite3_bind_int64(stmt, idx, arg);
-        } else if constexpr (std::is_same_v<const char *, arg_t> ||
-                             std::is_same_v<char *, arg_t>) {
-          sqlite3_bind_text(stmt, idx, arg, strlen(arg), SQLITE_STATIC);
-        } else if constexpr (std::is_same_v<std::string, arg_t>) {
-          sqlite3_bind_text(stmt, idx, &arg[0], arg.size(), SQLITE_STATIC);
-        } else if constexpr (std::is_same_v<blob, arg_t> ||
-                             std::is_same_v<blob_view, arg_t>) {
-          sqlite3_bind_blob(stmt, idx, &arg[0], arg.size(), SQLITE_STATIC);
-        } else if constexpr (std::is_same_v<std::nullopt_t, arg_t>) {
-          sqlite3_bind_null(stmt, idx);
-        } else if constexpr (detail::is_std_optional_type<arg_t>) {
-          if (arg) {
-            self(*arg, self);
-            return;
-          } else {
-            sqlite3_bind_null(stmt, idx);
-          }
-        } else {
-          static_assert(detail::dependent_false<arg_t>);
-        }
-        idx++;
-
-      };
-      (void)bind_dispatcher;
-      (bind_dispatcher(std::forward<Ts>(bind_args), bind_dispatcher), ...);
-
-      return QueryResult(stmt, &PreparedStmtCache<query_str>::put_tls);
-    }
+    return connection_tls().template query<query_str>(
+        std::forward<Ts>(bind_args)...);
   }
 
   // QueryResult corresponds to the results of a query executed by query().
@@ -473,16 +2482,32 @@ class Database {
   // directly.  When a QueryResult gets destroyed, the prepared statement is
   // cleaned up and gets placed into the prepared-statement cache it came from
   // for later reuse.
+  //
+  // A QueryResult may be moved to and consumed or destroyed on a thread other
+  // than the one that created it; the prepared statement still goes back to
+  // the creating thread's cache.  Unless `serialized_connections` is set, the
+  // creating thread must not use the database while another thread is
+  // stepping through the QueryResult, and the QueryResult must be destroyed
+  // before the creating thread exits.  Until the creating thread runs its next
+  // query, a statement given back this way stays unreset, and so may keep a
+  // read transaction open on the creating thread's connection.
   class QueryResult {
    public:
     QueryResult() = default;
 
+    QueryResult(QueryResult &&other) {
+      *this = std::move(other);
+    }
+
     QueryResult &operator=(QueryResult &&other) {
       if (this != &other) {
         std::swap(stmt, other.stmt);
-        std::swap(put_cb, other.put_cb);
+        std::swap(home, other.home);
         std::swap(ret, other.ret);
+        std::swap(column_count, other.column_count);
         std::swap(first_invocation, other.first_invocation);
+        std::swap(arena, other.arena);
+        std::swap(owned_arena, other.owned_arena);
       }
       return *this;
     }
@@ -491,9 +2516,7 @@ class Database {
       if (stmt == nullptr) {
         return;
       }
-      sqlite3_clear_bindings(stmt);
-      sqlite3_reset(stmt);
-      put_cb(stmt);
+      home->put(stmt);
     }
 
     // Returns the SQLite result code of the most recent call to sqlite3_step()
@@ -502,82 +2525,220 @@ class Database {
       return ret;
     }
 
+    // Returns the details of the error that `resultCode()` reports.  This must
+    // be called before the creating thread runs another query, which would
+    // replace SQLite's error message.
+    sqlite::error lastError(void) {
+      if (stmt == nullptr) {
+        return sqlite::error(ret);
+      }
+      return sqlite::error(ret, sqlite3_db_handle(stmt), home->query);
+    }
+
+    // Returns the number of columns in the result set.
+    int columnCount(void) {
+      return column_count;
+    }
+
+    // Returns the name of column IDX of the result set.
+    const char *columnName(int idx) {
+      return sqlite3_column_name(stmt, idx);
+    }
+
+    // Write the remaining rows as CSV to OUT, preceded by a line of column
+    // names if HEADER is true.  NULLs become empty fields, empty strings
+    // become "", and BLOBs are written in hexadecimal.  Returns the number of
+    // rows written.
+    std::size_t exportCsv(std::ostream &out, bool header = true) {
+      detail::RowWriter writer(out);
+      if (header) {
+        for (int i = 0; i < column_count; i++) {
+          if (i != 0) {
+            writer.push_back(',');
+          }
+          writer.csv_text(columnName(i));
+        }
+        writer.push_back('\n');
+      }
+      std::size_t rows = 0;
+      while ((*this)()) {
+        for (int i = 0; i < column_count; i++) {
+          if (i != 0) {
+            writer.push_back(',');
+          }
+          detail::write_column(writer, stmt, i, false);
+        }
+        writer.push_back('\n');
+        rows++;
+      }
+      if (ret != SQLITE_DONE) {
+        throw error(ret, sqlite3_db_handle(stmt), home->query);
+      }
+      return rows;
+    }
+
+    // Write the remaining rows to OUT as newline-delimited JSON, one object
+    // per row keyed by column name.  BLOBs are written as hexadecimal strings
+    // and non-finite floats as null.  Returns the number of rows written.
+    std::size_t exportNdjson(std::ostream &out) {
+      detail::RowWriter writer(out);
+      std::vector<std::string> keys(column_count);
+      for (int i = 0; i < column_count; i++) {
+        keys[i].push_back(i == 0 ? '{' : ',');
+        detail::append_json_string(keys[i], columnName(i));
+        keys[i].push_back(':');
+      }
+      std::size_t rows = 0;
+      while ((*this)()) {
+        for (int i = 0; i < column_count; i++) {
+          writer.append(keys[i]);
+          detail::write_column(writer, stmt, i, true);
+        }
+        writer.append(column_count == 0 ? "{}\n" : "}\n");
+        rows++;
+      }
+      if (ret != SQLITE_DONE) {
+        throw error(ret, sqlite3_db_handle(stmt), home->query);
+      }
+      return rows;
+    }
+
+    // Copy TEXT and BLOB columns fetched into `std::string_view`s and
+    // `sqlite::blob_view`s into ARENA from now on, so that they remain valid
+    // until ARENA is reset or destroyed.
+    void useArena(Arena &arena_) {
+      arena = &arena_;
+    }
+
+    // Like `useArena(Arena &)`, but with an arena owned by this QueryResult,
+    // which is returned.  Views into it remain valid until it is reset or
+    // this QueryResult is destroyed.
+    Arena &useArena(void) {
+      if (!owned_arena) {
+        owned_arena = std::make_unique<Arena>();
+      }
+      arena = owned_arena.get();
+      return *owned_arena;
+    }
+
     // Step through a row of results, binding the columns of the current row to
     // ARGS in order.  If there are no more rows, returns false.  Otherwise,
     // returns true.
     template <typename... Ts>
     bool operator()(Ts &&...args) {
-      if (static_cast<int>(sizeof...(args)) > sqlite3_column_count(stmt)) {
+      if (static_cast<int>(sizeof...(args)) > column_count) {
         throw error{SQLITE_ERROR};
       }
       if (!first_invocation) {
+        // Shared-cache table locks aren't waited out here; see
+        // `MemoryBudget::shared_cache`.
         ret = sqlite3_step(stmt);
       }
       if (ret != SQLITE_ROW) {
         return false;
       }
-      int idx = 0;
-      auto column_dispatcher = [this, &idx] (auto &&arg, auto &self) {
+      fetch_columns(std::index_sequence_for<Ts...>(), args...);
+      first_invocation = false;
+      return true;
+    }
+
+   private:
+    QueryResult(sqlite3_stmt *stmt_, detail::StmtHome *home_)
+        : stmt(stmt_), home(home_) {
+      ret = first_step(stmt);
+      // A cached statement is re-prepared inside its first step if the schema
+      // changed since, which may change its columns.
+      column_count = sqlite3_column_count(stmt);
+    }
+
+    QueryResult(const QueryResult &) = delete;
+    QueryResult &operator=(const QueryResult &) = delete;
+
+    template <std::size_t... idxs, typename... Ts>
+    void fetch_columns(std::index_sequence<idxs...>, Ts &...args) {
+      (fetch_column<static_cast<int>(idxs)>(args), ...);
+    }
 
-        using arg_t = std::decay_t<decltype(arg)>;
-        if constexpr (std::is_integral_v<arg_t>) {
-          arg = sqlite3_column_int64(stmt, idx);
-        } else if constexpr (std::is_same_v<std::string, arg_t> ||
-                             std::is_same_v<std::string_view, arg_t>) {
+    // Store column IDX of the current row into ARG, using the SQLite C API
+    // function matching ARG's type.  IDX being a template argument, each
+    // QueryResult invocation compiles down to a straight sequence of
+    // sqlite3_column_* calls.
+    template <int idx, typename T>
+    void fetch_column(T &arg) {
+      using arg_t = std::decay_t<T>;
+      if constexpr (std::is_integral_v<arg_t>) {
+        arg = sqlite3_column_int64(stmt, idx);
+      } else if constexpr (std::is_same_v<std::string, arg_t> ||
+                           std::is_same_v<std::string_view, arg_t>) {
+        auto ptr = (const char *)sqlite3_column_text(stmt, idx);
+        auto len = sqlite3_column_bytes(stmt, idx);
+        store_bytes(arg, ptr, len);
+      } else if constexpr (std::is_same_v<sqlite::blob, arg_t> ||
+                           std::is_same_v<sqlite::blob_view, arg_t>) {
+        auto ptr = (const char *)sqlite3_column_blob(stmt, idx);
+        auto len = sqlite3_column_bytes(stmt, idx);
+        store_bytes(arg, ptr, len);
+      } else if constexpr (std::is_same_v<std::nullopt_t, arg_t>) {
+        ;
+      } else if constexpr (detail::is_std_optional_type<arg_t>) {
+        using value_t = typename arg_t::value_type;
+        if constexpr (std::is_same_v<std::string, value_t> ||
+                      std::is_same_v<std::string_view, value_t>) {
+          // sqlite3_column_text() returns a null pointer exactly when the
+          // value is NULL, so there's no need to ask for the column's type
+          // first.
           auto ptr = (const char *)sqlite3_column_text(stmt, idx);
-          auto len = sqlite3_column_bytes(stmt, idx);
-          arg = arg_t(ptr, len);
-        } else if constexpr (std::is_same_v<sqlite::blob, arg_t> ||
-                             std::is_same_v<sqlite::blob_view, arg_t>) {
-          auto ptr = (const char *)sqlite3_column_blob(stmt, idx);
-          auto len = sqlite3_column_bytes(stmt, idx);
-          arg = arg_t(ptr, len);
-        } else if constexpr (std::is_same_v<std::nullopt_t, arg_t>) {
-          ;
-        } else if constexpr (detail::is_std_optional_type<arg_t>) {
-          if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+          if (ptr == nullptr) {
             arg.reset();
           } else {
-            typename arg_t::value_type nonnull_arg;
-            self(nonnull_arg, self);
-            arg = std::move(nonnull_arg);
-            return;
+            if (!arg) {
+              arg.emplace();
+            }
+            store_bytes(*arg, ptr, sqlite3_column_bytes(stmt, idx));
           }
-        } else if constexpr (user_deserialize_fn<arg_t> != nullptr) {
-          auto *fn_ptr = +user_deserialize_fn<arg_t>;
-          using fn_info = detail::get_fn_info<decltype(fn_ptr)>;
-          using from_type = typename fn_info::template arg_type<0>;
-          std::decay_t<from_type> from_arg;
-          self(from_arg, self);
-          arg = fn_ptr(std::move(from_arg));
-          return;
+        } else if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+          arg.reset();
         } else {
-          static_assert(detail::dependent_false<arg_t>);
+          if (!arg) {
+            arg.emplace();
+          }
+          fetch_column<idx>(*arg);
         }
-        idx++;
-
-      };
-      (void)column_dispatcher;
-      (column_dispatcher(std::forward<Ts>(args), column_dispatcher), ...);
-      first_invocation = false;
-      return true;
+      } else if constexpr (user_deserialize_fn<arg_t> != nullptr) {
+        auto *fn_ptr = +user_deserialize_fn<arg_t>;
+        using fn_info = detail::get_fn_info<decltype(fn_ptr)>;
+        using from_type = typename fn_info::template arg_type<0>;
+        std::decay_t<from_type> from_arg;
+        fetch_column<idx>(from_arg);
+        arg = fn_ptr(std::move(from_arg));
+      } else {
+        static_assert(detail::dependent_false<arg_t>);
+      }
     }
 
-   private:
-    using PutCallbackType = void (sqlite3_stmt *);
-
-    QueryResult(sqlite3_stmt *stmt_, PutCallbackType *put_cb_)
-        : stmt(stmt_), put_cb(put_cb_) {
-      ret = sqlite3_step(stmt);
+    // Store the LEN bytes at PTR, which belong to the current row, into ARG.
+    // Strings reuse their existing capacity; views point into the arena if
+    // there is one.
+    template <typename T>
+    void store_bytes(T &arg, const char *ptr, int len) {
+      if constexpr (std::is_same_v<std::string, T> ||
+                    std::is_same_v<sqlite::blob, T>) {
+        arg.assign(ptr, len);
+      } else {
+        if (arena != nullptr) {
+          ptr = arena->copy(ptr, len);
+        }
+        arg = T(ptr, len);
+      }
     }
 
-    QueryResult(const QueryResult &) = delete;
-    QueryResult &operator=(const QueryResult &) = delete;
-
     sqlite3_stmt *stmt = nullptr;
-    PutCallbackType *put_cb = nullptr;
+    detail::StmtHome *home = nullptr;
     int ret = -1;
+    int column_count = 0;
     bool first_invocation = true;
+    Arena *arena = nullptr;
+    std::unique_ptr<Arena> owned_arena;
 
     friend class Database<db_name>;
   };
@@ -648,6 +2809,393 @@ class Database {
     static const char rollback_transaction_query[] = "rollback transaction";
     query<rollback_transaction_query>();
   }
+
+  // Run the query QUERY_STR once per key range in PARTITIONS, binding the
+  // range's bounds to ?1 and ?2, on up to MAX_THREADS worker threads (by
+  // default one per hardware thread).  Each worker uses its own connection to
+  // the database, so the database must not be an in-memory one.  FN is
+  // invoked as `fn(partition_index, fetch_row)` on the worker thread, where
+  // `fetch_row` is the QueryResult for that partition.  If FN throws, no new
+  // partitions are started and the first exception is rethrown here once all
+  // workers have finished.
+  //
+  // Each worker scans its partitions inside a single read transaction.  When
+  // SQLite is built with SQLITE_ENABLE_SNAPSHOT and the database is in WAL
+  // mode, all workers additionally read from the same snapshot, taken on the
+  // calling thread's connection, so that the partitions are consistent with
+  // one another; a worker that can't open the snapshot fails the scan.  No
+  // snapshot can be taken while the calling thread has a write transaction
+  // open.  Returns whether the partitions were read from one snapshot.
+  template <const auto &query_str, typename Fn>
+  static bool parallelScan(const std::vector<KeyRange> &partitions, Fn &&fn,
+                           unsigned max_threads = 0) {
+    if (partitions.empty()) {
+      return true;
+    }
+    if (max_threads == 0) {
+      max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto num_threads = std::min<std::size_t>(max_threads, partitions.size());
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    // Hold a read transaction on this thread's connection (the caller's own,
+    // if one is open) until every worker is done, so that the snapshot cannot
+    // be checkpointed away.
+    sqlite3_snapshot *snapshot = nullptr;
+    std::optional<TransactionGuard> snapshot_txn;
+    if (sqlite3_get_autocommit(connection_tls().db_handle)) {
+      snapshot_txn.emplace();
+    }
+    static const char start_read_query[]
+      = "select count(*) from sqlite_master";
+    query<start_read_query>();
+    if (sqlite3_snapshot_get(connection_tls().db_handle, "main",
+                             &snapshot) != SQLITE_OK) {
+      snapshot = nullptr;
+    }
+#endif
+
+    std::atomic<std::size_t> next_partition{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr first_exception;
+    std::mutex exception_mutex;
+
+    auto worker = [&] (void) {
+      try {
+        TransactionGuard txn;
+#ifdef SQLITE_ENABLE_SNAPSHOT
+        if (snapshot != nullptr) {
+          auto &conn = connection_tls();
+          int ret = sqlite3_snapshot_open(conn.db_handle, "main", snapshot);
+          if (ret != SQLITE_OK) {
+            throw error(ret, conn.db_handle);
+          }
+        }
+#endif
+        for (;;) {
+          auto i = next_partition.fetch_add(1, std::memory_order_relaxed);
+          if (i >= partitions.size() || failed.load(std::memory_order_relaxed)) {
+            break;
+          }
+          QueryResult fetch_row = query<query_str>(partitions[i].first,
+                                                   partitions[i].last);
+          fn(i, fetch_row);
+        }
+      } catch (...) {
+        failed.store(true, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> guard(exception_mutex);
+        if (!first_exception) {
+          first_exception = std::current_exception();
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (std::size_t i = 0; i < num_threads; i++) {
+      threads.emplace_back(worker);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    sqlite3_snapshot_free(snapshot);
+#endif
+
+    if (first_exception) {
+      std::rethrow_exception(first_exception);
+    }
+#ifdef SQLITE_ENABLE_SNAPSHOT
+    return snapshot != nullptr;
+#else
+    return false;
+#endif
+  }
+
+  // Insert each CSV record read from IN by running the statement INSERT_QUERY
+  // with the record's fields bound as text to ?1, ?2, ....  Returns the
+  // number of records inserted.
+  //
+  // Input is read on a background thread and parsed on `options.threads`
+  // worker threads, while the calling thread binds and steps the statement on
+  // its own connection, committing every `options.rows_per_transaction` rows.
+  // If the calling thread already has a transaction open, the rows are
+  // inserted within it instead.  Malformed input throws error{SQLITE_FORMAT};
+  // on any error the current transaction is rolled back, so rows committed by
+  // earlier transactions remain.
+  template <const auto &insert_query>
+  static std::size_t importCsv(std::istream &in, ImportOptions options = {}) {
+    return import_records<insert_query>(in, options, true);
+  }
+
+  // Like `importCsv`, but reading newline-delimited JSON objects.  The value
+  // of each member is bound to the parameter of the same name prefixed with a
+  // colon (`:name`); members without a matching parameter are ignored, and
+  // parameters without a matching member are bound to NULL.  Booleans bind as
+  // 1 or 0, and nested objects and arrays as their JSON text.
+  template <const auto &insert_query>
+  static std::size_t importNdjson(std::istream &in,
+                                  ImportOptions options = {}) {
+    return import_records<insert_query>(in, options, false);
+  }
+
+ private:
+  // Step STMT for the first time.  In shared-cache mode, table locks held by
+  // other connections are waited out, the way the busy handler waits out
+  // SQLITE_BUSY; see `MemoryBudget::shared_cache`.
+  static int first_step(sqlite3_stmt *stmt) {
+    int ret = sqlite3_step(stmt);
+    if (ret != SQLITE_LOCKED) {
+      return ret;
+    }
+    sqlite3 *db_handle = sqlite3_db_handle(stmt);
+#ifndef SQLITE_ENABLE_UNLOCK_NOTIFY
+    auto deadline = std::chrono::steady_clock::now()
+                    + memory_budget.shared_cache_lock_timeout;
+#endif
+    while (ret == SQLITE_LOCKED &&
+           sqlite3_extended_errcode(db_handle) == SQLITE_LOCKED_SHAREDCACHE) {
+#ifdef SQLITE_ENABLE_UNLOCK_NOTIFY
+      if (detail::wait_for_unlock_notify(db_handle) != SQLITE_OK) {
+        break;
+      }
+#else
+      if (std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+      std::this_thread::yield();
+#endif
+      sqlite3_reset(stmt);
+      ret = sqlite3_step(stmt);
+    }
+    return ret;
+  }
+
+  // Returns the length of the longest prefix of INPUT made of whole records,
+  // which is zero if INPUT doesn't hold a complete record.  Newlines within
+  // quoted CSV fields don't end a record.
+  static std::size_t complete_records(std::string_view input, bool csv) {
+    if (!csv) {
+      auto newline = input.rfind('\n');
+      return newline == std::string_view::npos ? 0 : newline + 1;
+    }
+    std::size_t end = 0;
+    bool in_quotes = false;
+    for (std::size_t i = 0; i < input.size(); i++) {
+      if (input[i] == '"') {
+        in_quotes = !in_quotes;
+      } else if (input[i] == '\n' && !in_quotes) {
+        end = i + 1;
+      }
+    }
+    return end;
+  }
+
+  template <const auto &insert_query>
+  static std::size_t import_records(std::istream &in,
+                                    const ImportOptions &options, bool csv) {
+    struct ParseJob {
+      std::string input;
+      bool first;
+      std::promise<detail::ImportChunk> result;
+    };
+
+    auto num_threads = options.threads;
+    if (num_threads == 0) {
+      num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto chunk_size = std::max<std::size_t>(options.chunk_size, 1);
+
+    // Chunks are parsed in any order but inserted in the order they were
+    // read, by waiting on their futures in turn.
+    detail::BlockingQueue<ParseJob> jobs(num_threads * 2);
+    detail::BlockingQueue<std::future<detail::ImportChunk>> results(
+        num_threads * 2);
+
+    auto reader = [&] (void) {
+      std::string pending;
+      bool first = true, eof = false;
+      while (!eof) {
+        auto old_size = pending.size();
+        pending.resize(old_size + chunk_size);
+        in.read(pending.data() + old_size,
+                static_cast<std::streamsize>(chunk_size));
+        pending.resize(old_size + static_cast<std::size_t>(in.gcount()));
+        eof = !in;
+
+        ParseJob job;
+        if (in.bad()) {
+          job.result.set_exception(
+              std::make_exception_ptr(error{SQLITE_IOERR}));
+          results.push(job.result.get_future());
+          break;
+        }
+        auto end = eof ? pending.size() : complete_records(pending, csv);
+        if (end == 0) {
+          continue;
+        }
+        job.input = pending.substr(0, end);
+        job.first = first;
+        pending.erase(0, end);
+        first = false;
+        if (!results.push(job.result.get_future()) ||
+            !jobs.push(std::move(job))) {
+          break;
+        }
+      }
+      jobs.close();
+      results.close();
+    };
+
+    auto parser = [&] (void) {
+      while (auto job = jobs.pop()) {
+        try {
+          if (csv) {
+            job->result.set_value(detail::parse_csv_chunk(
+                job->input, job->first && options.header,
+                options.empty_as_null));
+          } else {
+            detail::ImportChunk chunk;
+            detail::NdjsonParser(job->input, chunk).parse();
+            job->result.set_value(std::move(chunk));
+          }
+        } catch (...) {
+          job->result.set_exception(std::current_exception());
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads + 1);
+    threads.emplace_back(reader);
+    for (unsigned i = 0; i < num_threads; i++) {
+      threads.emplace_back(parser);
+    }
+
+    detail::StmtHome *home = nullptr;
+    sqlite3_stmt *stmt = nullptr;
+    bool own_transaction = false;
+    std::size_t rows = 0;
+    try {
+      auto &conn = connection_tls();
+      stmt = PreparedStmtCache<insert_query>::get(conn, home);
+      bool manage_transactions = sqlite3_get_autocommit(conn.db_handle);
+
+      // Unlike `commitTransaction`, fail if the commit does, e.g. because of
+      // a deferred constraint violation.
+      auto commit = [&conn] (void) {
+        static const char commit_query[] = "commit transaction";
+        QueryResult result = query<commit_query>();
+        if (result.resultCode() != SQLITE_DONE) {
+          throw error(result.resultCode(), conn.db_handle, commit_query);
+        }
+      };
+
+      // The parameter index of the NDJSON key last seen at each position, so
+      // that objects with the same layout skip the name lookup.
+      std::vector<std::pair<std::string, int>> key_params;
+      std::string param_name;
+
+      while (auto future = results.pop()) {
+        detail::ImportChunk chunk = future->get();
+        std::size_t field = 0;
+        for (auto record_end : chunk.record_ends) {
+          if (manage_transactions && !own_transaction) {
+            beginTransaction();
+            own_transaction = true;
+          }
+          for (int position = 0; field < record_end; field++, position++) {
+            const auto &value = chunk.fields[field];
+            int idx = position + 1;
+            if (!csv) {
+              std::string_view key(chunk.storage.data() + value.key_offset,
+                                   value.key_len);
+              if (key_params.size() <= static_cast<std::size_t>(position)) {
+                key_params.resize(position + 1, {std::string(), 0});
+              }
+              auto &cached = key_params[position];
+              if (cached.second == 0 || cached.first != key) {
+                param_name.assign(1, ':');
+                param_name.append(key);
+                cached.first.assign(key);
+                cached.second = sqlite3_bind_parameter_index(
+                    stmt, param_name.c_str());
+                if (cached.second == 0) {
+                  cached.second = -1;
+                }
+              }
+              idx = cached.second;
+              if (idx < 0) {
+                continue;
+              }
+            }
+            int ret = SQLITE_OK;
+            switch (value.kind) {
+              case detail::ImportField::null_value:
+                ret = sqlite3_bind_null(stmt, idx);
+                break;
+              case detail::ImportField::text:
+                ret = sqlite3_bind_text(stmt, idx,
+                                        chunk.storage.data() + value.text_offset,
+                                        static_cast<int>(value.text_len),
+                                        SQLITE_STATIC);
+                break;
+              case detail::ImportField::integer:
+                ret = sqlite3_bind_int64(stmt, idx, value.integer_value);
+                break;
+              case detail::ImportField::real:
+                ret = sqlite3_bind_double(stmt, idx, value.real_value);
+                break;
+            }
+            if (ret != SQLITE_OK) {
+              throw error(ret, conn.db_handle, home->query);
+            }
+          }
+          int ret = first_step(stmt);
+          if (ret != SQLITE_DONE) {
+            error e(ret, conn.db_handle, home->query);
+            sqlite3_reset(stmt);
+            throw e;
+          }
+          sqlite3_reset(stmt);
+          sqlite3_clear_bindings(stmt);
+          rows++;
+          if (own_transaction && options.rows_per_transaction != 0 &&
+              rows % options.rows_per_transaction == 0) {
+            commit();
+            own_transaction = false;
+          }
+        }
+      }
+      if (own_transaction) {
+        commit();
+        own_transaction = false;
+      }
+    } catch (...) {
+      results.close();
+      jobs.close();
+      for (auto &thread : threads) {
+        thread.join();
+      }
+      if (stmt != nullptr) {
+        home->put(stmt);
+      }
+      if (own_transaction) {
+        try {
+          rollbackTransaction();
+        } catch (...) {
+        }
+      }
+      throw;
+    }
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    home->put(stmt);
+    return rows;
+  }
 };
 
 } // namespace sqlite
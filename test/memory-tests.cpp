@@ -0,0 +1,71 @@
+#include "SQLiteWrapper.h"
+#include <cassert>
+
+static const char db_name[] = ":memory:";
+using db = sqlite::Database<db_name>;
+
+static const char create_table_query[] = "create table test (a, b)";
+static const char insert_query[] = "insert into test (a, b) values (?1, ?2)";
+static const char select_query[] = "select a, b from test order by b";
+
+void test_size_classes(void) {
+  using namespace sqlite::detail::pool;
+  assert(round_up(1) == 16);
+  assert(round_up(16) == 16);
+  assert(round_up(17) == 32);
+  assert(round_up(256) == 256);
+  assert(round_up(257) == 512);
+  assert(round_up(max_pooled_size) == max_pooled_size);
+  assert(round_up(max_pooled_size + 1) == max_pooled_size + 16);
+  assert(size_class_of(max_pooled_size) == num_size_classes - 1);
+}
+
+void run_queries(void) {
+  db::query<create_table_query>();
+  for (int i = 0; i < 1000; i++) {
+    db::query<insert_query>(i, std::string(i % 300, 'x'));
+  }
+  auto fetch_row = db::query<select_query>();
+  int count = 0;
+  while (fetch_row()) {
+    count++;
+  }
+  assert(count == 1000);
+}
+
+int main(void) {
+  test_size_classes();
+
+  sqlite::MemoryOptions options;
+  options.thread_local_pools = true;
+  options.memstatus = false;
+  options.lookaside_slot_size = 128;
+  options.lookaside_slot_count = 64;
+  sqlite::configureMemory(options);
+
+  run_queries();
+
+  // Each thread gets its own in-memory database and its own pool.
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; i++) {
+    threads.emplace_back(run_queries);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  auto stats = sqlite::memoryStats();
+  assert(stats.allocations > 0);
+  assert(stats.pool_hits > 0);
+  assert(stats.pool_hits <= stats.allocations);
+  assert(stats.bytes_in_use > 0);
+  assert(stats.bytes_cached >= 0);
+
+  bool caught = false;
+  try {
+    sqlite::configureMemory(options);
+  } catch (const sqlite::error &e) {
+    caught = (e.err_code == SQLITE_MISUSE);
+  }
+  assert(caught);
+}
@@ -0,0 +1,393 @@
+#include "SQLiteWrapper.h"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <condition_variable>
+#include <deque>
+
+static const char db_name[] = ":memory:";
+using db = sqlite::Database<db_name>;
+
+static const char serialized_db_name[] = ":memory:";
+using serialized_db = sqlite::Database<serialized_db_name>;
+
+static const char create_table_query[] = "create table test (a, b)";
+static const char insert_query[] = "insert into test (a, b) values (?1, ?2)";
+static const char select_query[] = "select a, b from test where a >= ?1 order by a";
+
+void test_handoff(void) {
+  db::query<create_table_query>();
+  for (int i = 0; i < 10; i++) {
+    db::query<insert_query>(i, "hello");
+  }
+
+  // Step through and destroy the QueryResult on another thread, then make sure
+  // the statement is reusable from this thread.
+  for (int round = 0; round < 3; round++) {
+    db::QueryResult fetch_row = db::query<select_query>(5);
+    std::thread consumer([fetch_row = std::move(fetch_row)] () mutable {
+      int a, expected = 5;
+      std::string b;
+      while (fetch_row(a, b)) {
+        assert(a == expected++);
+        assert(b == "hello");
+      }
+      assert(expected == 10);
+    });
+    consumer.join();
+  }
+
+  auto fetch_row = db::query<select_query>(0);
+  int a, count = 0;
+  while (fetch_row(a)) {
+    count++;
+  }
+  assert(count == 10);
+}
+
+static std::string handoff_db_name(void) {
+  return "multi-thread-tests-handoff.db";
+}
+using handoff_db = sqlite::Database<handoff_db_name>;
+
+void test_handoff_releases_locks(void) {
+  std::remove(handoff_db_name().c_str());
+  handoff_db::query<create_table_query>();
+  for (int i = 0; i < 10; i++) {
+    handoff_db::query<insert_query>(i, "hello");
+  }
+
+  // A cursor abandoned part way through on another thread is reset by the
+  // creating thread's next query, so it doesn't keep holding a read lock.
+  handoff_db::QueryResult fetch_row = handoff_db::query<select_query>(0);
+  std::thread consumer([fetch_row = std::move(fetch_row)] () mutable {
+    int a;
+    bool has_row = fetch_row(a);
+    assert(has_row);
+  });
+  consumer.join();
+  static const char count_query[] = "select count(*) from test";
+  int count = 0;
+  bool has_count = handoff_db::query<count_query>()(count);
+  assert(has_count && count == 10);
+
+  sqlite3 *writer = nullptr;
+  sqlite3_open(handoff_db_name().c_str(), &writer);
+  int ret = sqlite3_exec(writer, "insert into test values (10, 'hello')",
+                         nullptr, nullptr, nullptr);
+  assert(ret == SQLITE_OK);
+  sqlite3_close(writer);
+
+  handoff_db::disconnect();
+  std::remove(handoff_db_name().c_str());
+}
+
+void test_serialized_producer_consumer(void) {
+  serialized_db::serialized_connections = true;
+
+  serialized_db::query<create_table_query>();
+  for (int i = 0; i < 100; i++) {
+    serialized_db::query<insert_query>(i, "hello");
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<serialized_db::QueryResult> cursors;
+  bool done = false;
+  int rows_seen = 0;
+
+  std::thread consumer([&] {
+    for (;;) {
+      serialized_db::QueryResult fetch_row;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return done || !cursors.empty(); });
+        if (cursors.empty()) {
+          return;
+        }
+        fetch_row = std::move(cursors.front());
+        cursors.pop_front();
+      }
+      int a;
+      while (fetch_row(a)) {
+        rows_seen++;
+      }
+    }
+  });
+
+  // Keep using the connection on this thread while the consumer steps through
+  // cursors created here.
+  for (int i = 0; i < 50; i++) {
+    auto fetch_row = serialized_db::query<select_query>(90);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      cursors.push_back(std::move(fetch_row));
+    }
+    cv.notify_one();
+    auto check_row = serialized_db::query<select_query>(99);
+    int a;
+    bool has_row = check_row(a);
+    assert(has_row && a == 99);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+  }
+  cv.notify_one();
+  consumer.join();
+
+  assert(rows_seen == 50 * 10);
+}
+
+static std::string scan_db_name(void) {
+  return "multi-thread-tests-scan.db";
+}
+using scan_db = sqlite::Database<scan_db_name>;
+
+static void remove_scan_db(void) {
+  for (const char *suffix : {"", "-wal", "-shm"}) {
+    std::remove((scan_db_name() + suffix).c_str());
+  }
+}
+
+void test_parallel_scan(void) {
+  remove_scan_db();
+  scan_db::post_connection_hook = [] (sqlite3 *db_handle) {
+    sqlite3_exec(db_handle, "pragma journal_mode = wal",
+                 nullptr, nullptr, nullptr);
+  };
+
+  static const char create_scan_table_query[]
+    = "create table scan (id integer primary key, value integer)";
+  scan_db::query<create_scan_table_query>();
+  static const char insert_scan_query[]
+    = "insert into scan (id, value) values (?1, ?2)";
+  std::int64_t expected_sum = 0;
+  {
+    scan_db::TransactionGuard txn;
+    for (int i = 0; i < 1000; i++) {
+      scan_db::query<insert_scan_query>(i, i * 3);
+      expected_sum += i * 3;
+    }
+  }
+
+  static const char range_query[]
+    = "select value from scan where id >= ?1 and id < ?2";
+  auto partitions = sqlite::splitKeyRange(0, 1000, 7);
+  assert(partitions.size() == 7);
+  assert(partitions.front().first == 0 && partitions.back().last == 1000);
+  auto full = sqlite::splitKeyRange(INT64_MIN, INT64_MAX, 2);
+  assert(full.size() == 2);
+  assert(full[0].first == INT64_MIN && full[0].last == 0);
+  assert(full[1].first == 0 && full[1].last == INT64_MAX);
+
+  std::atomic<std::int64_t> sum{0};
+  std::atomic<int> rows{0};
+  bool one_snapshot = scan_db::parallelScan<range_query>(partitions,
+      [&] (std::size_t, scan_db::QueryResult &fetch_row) {
+        std::int64_t value;
+        while (fetch_row(value)) {
+          sum += value;
+          rows++;
+        }
+      }, 4);
+  assert(rows == 1000);
+  assert(sum == expected_sum);
+#ifdef SQLITE_ENABLE_SNAPSHOT
+  assert(one_snapshot);
+#else
+  assert(!one_snapshot);
+#endif
+
+  bool caught = false;
+  try {
+    scan_db::parallelScan<range_query>(partitions,
+        [&] (std::size_t i, scan_db::QueryResult &) {
+          if (i == 3) {
+            throw std::runtime_error("partition failed");
+          }
+        });
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  assert(caught);
+
+  scan_db::disconnect();
+  remove_scan_db();
+}
+
+static std::string shared_cache_db_name(void) {
+  return "multi-thread-tests-shared-cache.db";
+}
+using shared_cache_db = sqlite::Database<shared_cache_db_name>;
+
+void test_shared_cache_budget(void) {
+  std::remove(shared_cache_db_name().c_str());
+  shared_cache_db::memory_budget.shared_cache = true;
+  shared_cache_db::memory_budget.cache_size_kib = 512;
+  shared_cache_db::memory_budget.soft_heap_limit = 64 * 1024 * 1024;
+
+  static const char create_table_query[]
+    = "create table test (id integer primary key, value text)";
+  static const char insert_query[] = "insert into test values (?1, ?2)";
+  static const char count_query[] = "select count(*), sum(length(value)) from test";
+  shared_cache_db::query<create_table_query>();
+  {
+    shared_cache_db::TransactionGuard txn;
+    for (int i = 0; i < 2000; i++) {
+      shared_cache_db::query<insert_query>(i, std::string(100, 'x'));
+    }
+  }
+  assert(sqlite3_soft_heap_limit64(-1) == 64 * 1024 * 1024);
+
+  // Readers and a writer on different connections sharing one cache.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([] {
+      for (int i = 0; i < 20; i++) {
+        int count = 0;
+        std::int64_t total_length = 0;
+        bool has_row
+          = shared_cache_db::query<count_query>()(count, total_length);
+        assert(has_row && count >= 2000 && total_length == count * 100);
+      }
+      auto stats = shared_cache_db::cacheStats();
+      assert(stats.cache_used > 0);
+      assert(stats.cache_used_shared <= stats.cache_used);
+    });
+  }
+  threads.emplace_back([] {
+    for (int i = 2000; i < 2100; i++) {
+      shared_cache_db::query<insert_query>(i, std::string(100, 'y'));
+    }
+  });
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  int count = 0;
+  std::int64_t total_length = 0;
+  bool has_row = shared_cache_db::query<count_query>()(count, total_length);
+  assert(has_row && count == 2100);
+
+  // Two transactions that each wait for a table locked by the other give up
+  // rather than wait forever.
+  static const char create_t1_query[] = "create table t1 (a)";
+  static const char create_t2_query[] = "create table t2 (a)";
+  static const char insert_t1_query[] = "insert into t1 values (1)";
+  static const char insert_t2_query[] = "insert into t2 values (1)";
+  static const char select_t1_query[] = "select * from t1";
+  static const char select_t2_query[] = "select * from t2";
+  shared_cache_db::query<create_t1_query>();
+  shared_cache_db::query<create_t2_query>();
+  shared_cache_db::memory_budget.shared_cache_lock_timeout
+    = std::chrono::milliseconds(100);
+  std::atomic<int> ready{0};
+  int writer_ret = SQLITE_OK, reader_ret = SQLITE_OK;
+  std::thread writer([&] {
+    shared_cache_db::beginTransaction();
+    shared_cache_db::query<insert_t1_query>();
+    ready++;
+    while (ready < 2) {
+      std::this_thread::yield();
+    }
+    writer_ret = shared_cache_db::query<insert_t2_query>().resultCode();
+    shared_cache_db::rollbackTransaction();
+  });
+  std::thread reader([&] {
+    shared_cache_db::beginTransaction();
+    shared_cache_db::query<select_t2_query>();
+    ready++;
+    while (ready < 2) {
+      std::this_thread::yield();
+    }
+    reader_ret = shared_cache_db::query<select_t1_query>().resultCode();
+    shared_cache_db::rollbackTransaction();
+  });
+  writer.join();
+  reader.join();
+  assert(writer_ret == SQLITE_LOCKED || reader_ret == SQLITE_LOCKED);
+
+  sqlite3_soft_heap_limit64(0);
+  shared_cache_db::disconnect();
+  std::remove(shared_cache_db_name().c_str());
+}
+
+static std::string changes_db_name(void) {
+  return "multi-thread-tests-changes.db";
+}
+using changes_db = sqlite::Database<changes_db_name>;
+
+void test_change_stream(void) {
+  std::remove(changes_db_name().c_str());
+  static const char create_table_query[]
+    = "create table test (id integer primary key, value)";
+  static const char insert_query[] = "insert into test values (?1, ?2)";
+  static const char update_query[] = "update test set value = ?2 where id = ?1";
+  static const char delete_query[] = "delete from test where id = ?1";
+  changes_db::query<create_table_query>();
+
+  std::mutex mutex;
+  std::vector<sqlite::ChangeBatch> batches;
+  auto id = changes_db::subscribe([&] (const sqlite::ChangeBatch &batch) {
+    std::lock_guard<std::mutex> guard(mutex);
+    batches.push_back(batch);
+  });
+
+  // Autocommitted statements each make a batch of their own.
+  changes_db::query<insert_query>(1, "a");
+  changes_db::query<update_query>(1, "b");
+
+  // Rolled back transactions are not reported.
+  {
+    changes_db::TransactionGuard txn;
+    changes_db::query<insert_query>(2, "c");
+    txn.rollback();
+  }
+
+  // Changes made on another thread's connection are reported too, one batch
+  // per transaction.
+  std::thread writer([] {
+    changes_db::TransactionGuard txn;
+    changes_db::query<insert_query>(3, "d");
+    changes_db::query<delete_query>(1);
+  });
+  writer.join();
+
+  changes_db::waitForChanges();
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    assert(batches.size() == 3);
+    assert(batches[0].size() == 1);
+    assert(batches[0][0].operation == SQLITE_INSERT);
+    assert(batches[0][0].database == "main");
+    assert(batches[0][0].table == "test");
+    assert(batches[0][0].rowid == 1);
+    assert(batches[1].size() == 1 && batches[1][0].operation == SQLITE_UPDATE);
+    assert(batches[2].size() == 2);
+    assert(batches[2][0].operation == SQLITE_INSERT && batches[2][0].rowid == 3);
+    assert(batches[2][1].operation == SQLITE_DELETE && batches[2][1].rowid == 1);
+  }
+
+  changes_db::unsubscribe(id);
+  changes_db::query<insert_query>(4, "e");
+  changes_db::waitForChanges();
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    assert(batches.size() == 3);
+  }
+
+  changes_db::disconnect();
+  std::remove(changes_db_name().c_str());
+}
+
+int main(void) {
+  test_handoff();
+  test_handoff_releases_locks();
+
+  test_serialized_producer_consumer();
+  test_parallel_scan();
+  test_shared_cache_budget();
+  test_change_stream();
+}
@@ -1,5 +1,9 @@
 #include "SQLiteWrapper.h"
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
 
 static const char db_name[] = ":memory:";
 using db = sqlite::Database<db_name>;
@@ -54,6 +58,458 @@ void test_transactions(void) {
   assert(fetch_row.resultCode() == SQLITE_ROW);
 }
 
+void test_optionals(void) {
+  db::query<insert_query>(1, std::nullopt);
+  db::query<insert_query>(2, "");
+  db::query<insert_query>(3, sqlite::blob_view{""});
+  db::query<insert_query>(4, std::optional<int>(42));
+
+  std::optional<std::string> str = "stale";
+  std::optional<std::string_view> view;
+  std::optional<sqlite::blob> blob;
+  std::optional<int> integer;
+
+  auto fetch_row = db::query<select_query>(1);
+  bool has_row = fetch_row(std::nullopt, str);
+  assert(has_row);
+  assert(!str);
+
+  fetch_row = db::query<select_query>(2);
+  has_row = fetch_row(std::nullopt, str);
+  assert(has_row);
+  assert(str && str->empty());
+  fetch_row = db::query<select_query>(2);
+  has_row = fetch_row(std::nullopt, view);
+  assert(has_row);
+  assert(view && view->empty());
+
+  // An empty BLOB is not NULL even though sqlite3_column_blob() returns a
+  // null pointer for it.
+  fetch_row = db::query<select_query>(3);
+  has_row = fetch_row(std::nullopt, blob);
+  assert(has_row);
+  assert(blob && blob->empty());
+
+  fetch_row = db::query<select_query>(4);
+  has_row = fetch_row(std::nullopt, integer);
+  assert(has_row);
+  assert(integer && *integer == 42);
+  fetch_row = db::query<select_query>(1);
+  has_row = fetch_row(std::nullopt, integer);
+  assert(has_row);
+  assert(!integer);
+
+  // A cached statement re-prepared after a schema change reports its new
+  // columns.
+  static const char create_alter_query[] = "create table alter_test (a, b)";
+  static const char insert_alter_query[]
+    = "insert into alter_test values (1, 2)";
+  static const char select_alter_query[] = "select * from alter_test";
+  static const char alter_query[] = "alter table alter_test add column c";
+  db::query<create_alter_query>();
+  db::query<insert_alter_query>();
+  int ncols = db::query<select_alter_query>().columnCount();
+  assert(ncols == 2);
+  db::query<alter_query>();
+  fetch_row = db::query<select_alter_query>();
+  ncols = fetch_row.columnCount();
+  assert(ncols == 3);
+  int a = 0, b = 0;
+  has_row = fetch_row(a, b, integer);
+  assert(has_row && a == 1 && b == 2 && !integer);
+}
+
+void test_arena(void) {
+  std::string long_value(1000, 'x');
+  for (int i = 0; i < 100; i++) {
+    db::query<insert_query>(i, i % 2 ? std::string("short") : long_value);
+  }
+
+  static const char select_all_query[] = "select a, b from test order by a";
+  sqlite::Arena arena(4096);
+  for (int round = 0; round < 2; round++) {
+    auto fetch_row = db::query<select_all_query>();
+    fetch_row.useArena(arena);
+    std::vector<std::string_view> values;
+    std::string_view value;
+    while (fetch_row(std::nullopt, value)) {
+      values.push_back(value);
+    }
+    // The views outlive the rows they were fetched from.
+    assert(values.size() == 100);
+    for (std::size_t i = 0; i < values.size(); i++) {
+      assert(values[i] == (i % 2 ? "short" : long_value));
+    }
+    assert(arena.bytesUsed() == 50 * 5 + 50 * 1000);
+    arena.reset();
+    assert(arena.bytesUsed() == 0);
+  }
+
+  auto fetch_row = db::query<select_all_query>();
+  sqlite::Arena &own_arena = fetch_row.useArena();
+  sqlite::blob_view first;
+  bool has_row = fetch_row(std::nullopt, first);
+  assert(has_row);
+  while (fetch_row()) {
+    ;
+  }
+  assert(first == long_value);
+  assert(own_arena.bytesUsed() == 1000);
+}
+
+static const char diagnostics_db_name[] = ":memory:";
+using diagnostics_db = sqlite::Database<diagnostics_db_name>;
+
+void test_query_plans_and_slow_queries(void) {
+  std::vector<sqlite::QueryPlan> plans;
+  diagnostics_db::query_plan_hook = [&plans] (const sqlite::QueryPlan &plan) {
+    plans.push_back(plan);
+  };
+  std::vector<std::string> slow_queries;
+  diagnostics_db::slow_query_hook
+    = [&slow_queries] (std::string_view sql, std::chrono::nanoseconds) {
+      slow_queries.emplace_back(sql);
+    };
+  diagnostics_db::slow_query_threshold = std::chrono::nanoseconds(0);
+
+  static const char create_table_query[] = "create table test (a, b)";
+  static const char create_index_query[] = "create index test_a on test (a)";
+  diagnostics_db::query<create_table_query>();
+  diagnostics_db::query<create_index_query>();
+  plans.clear();
+
+  static const char lookup_query[] = "select b from test where a = ?1";
+  diagnostics_db::query<lookup_query>(1);
+  diagnostics_db::query<lookup_query>(2);
+  assert(plans.size() == 1);
+  assert(plans[0].query == lookup_query);
+  assert(!plans[0].full_scan && !plans[0].temp_btree);
+
+  static const char sorted_scan_query[] = "select a from test order by b";
+  diagnostics_db::query<sorted_scan_query>();
+  assert(plans.size() == 2);
+  assert(plans[1].full_scan && plans[1].temp_btree);
+
+  assert(std::find(slow_queries.begin(), slow_queries.end(),
+                   "select b from test where a = 2") != slow_queries.end());
+
+  diagnostics_db::query_plan_hook = nullptr;
+  diagnostics_db::slow_query_hook = nullptr;
+}
+
+static const char connections_db_name[] = ":memory:";
+using connections_db = sqlite::Database<connections_db_name>;
+
+void test_explicit_connections(void) {
+  static const char create_table_query[] = "create table test (a, b)";
+  static const char count_tables_query[]
+    = "select count(*) from sqlite_master where type = 'table'";
+
+  // The calling thread's implicit connection can be opened, primed and closed
+  // explicitly.
+  assert(!connections_db::isConnected());
+  connections_db::connect();
+  assert(connections_db::isConnected());
+  connections_db::query<create_table_query>();
+  connections_db::prepare<insert_query, select_query>();
+  connections_db::query<insert_query>(1, "hello");
+  int ret = connections_db::query<select_query>(1).resultCode();
+  assert(ret == SQLITE_ROW);
+
+  // A QueryResult may outlive the connection it came from being closed.
+  auto pending_row = connections_db::query<select_query>(1);
+  connections_db::disconnect();
+  assert(!connections_db::isConnected());
+  pending_row = connections_db::QueryResult();
+
+  // The next query reopens the connection, here to a new in-memory database.
+  int tables = -1;
+  bool has_row = connections_db::query<count_tables_query>()(tables);
+  assert(has_row && tables == 0);
+  assert(connections_db::isConnected());
+
+  // Explicit connections are independent of the implicit one.
+  connections_db::Connection conn;
+  assert(conn.isOpen() && conn.handle() != nullptr);
+  conn.query<create_table_query>();
+  conn.query<insert_query>(2, "goodbye");
+  std::string b;
+  auto fetch_row = conn.query<select_query>(2);
+  has_row = fetch_row(std::nullopt, b);
+  assert(has_row && b == "goodbye");
+  fetch_row = connections_db::QueryResult();
+  has_row = connections_db::query<count_tables_query>()(tables);
+  assert(has_row && tables == 0);
+
+  connections_db::Connection moved_conn = std::move(conn);
+  assert(!conn.isOpen());
+  ret = moved_conn.query<select_query>(2).resultCode();
+  assert(ret == SQLITE_ROW);
+  moved_conn.close();
+  assert(!moved_conn.isOpen());
+  has_row = moved_conn.query<count_tables_query>()(tables);
+  assert(has_row && tables == 0);
+}
+
+static std::string snapshot_db_name(void) {
+  return "single-thread-tests-snap?shot#1%.db";
+}
+using writable_snapshot_db = sqlite::Database<snapshot_db_name>;
+
+// The same database file, opened as an immutable snapshot.
+static std::string immutable_snapshot_db_name(void) {
+  return snapshot_db_name();
+}
+using immutable_snapshot_db = sqlite::Database<immutable_snapshot_db_name>;
+
+void test_immutable_snapshot(void) {
+  std::remove(snapshot_db_name().c_str());
+  assert(sqlite::detail::immutable_uri("a?b#c%d")
+         == "file:a%3fb%23c%25d?immutable=1");
+
+  static const char create_table_query[] = "create table test (a, b)";
+  writable_snapshot_db::query<create_table_query>();
+  writable_snapshot_db::query<insert_query>(1, "hello");
+  writable_snapshot_db::disconnect();
+
+  immutable_snapshot_db::immutable = true;
+  std::string b;
+  bool has_row = immutable_snapshot_db::query<select_query>(1)(std::nullopt, b);
+  assert(has_row && b == "hello");
+  int ret = immutable_snapshot_db::query<insert_query>(2, "goodbye")
+              .resultCode();
+  assert(ret == SQLITE_READONLY);
+
+  static const char mmap_size_query[] = "pragma mmap_size";
+  sqlite3_int64 mmap_size = 0;
+  has_row = immutable_snapshot_db::query<mmap_size_query>()(mmap_size);
+  assert(has_row && mmap_size > 0);
+
+  immutable_snapshot_db::disconnect();
+  std::remove(snapshot_db_name().c_str());
+}
+
+void test_export_and_import(void) {
+  db::query<insert_query>(1, "plain");
+  db::query<insert_query>(2, "needs, \"quoting\"\nhere");
+  db::query<insert_query>(3, std::nullopt);
+  static const char insert_real_query[]
+    = "insert into test (a, b) values (4.5, x'01ab')";
+  db::query<insert_real_query>();
+
+  static const char select_all_query[] = "select a, b from test order by a";
+  std::ostringstream csv;
+  std::size_t exported = db::query<select_all_query>().exportCsv(csv);
+  assert(exported == 4);
+  assert(csv.str() == "a,b\n"
+                      "1,plain\n"
+                      "2,\"needs, \"\"quoting\"\"\nhere\"\n"
+                      "3,\n"
+                      "4.5,01ab\n");
+
+  std::ostringstream ndjson;
+  exported = db::query<select_all_query>().exportNdjson(ndjson);
+  assert(exported == 4);
+  assert(ndjson.str() == "{\"a\":1,\"b\":\"plain\"}\n"
+                         "{\"a\":2,\"b\":\"needs, \\\"quoting\\\"\\nhere\"}\n"
+                         "{\"a\":3,\"b\":null}\n"
+                         "{\"a\":4.5,\"b\":\"01ab\"}\n");
+
+  // Importing what was exported, in small chunks on several threads, gives
+  // back the same rows (BLOBs aside, which come back as their hex text).
+  static const char count_query[]
+    = "select count(*), cast(sum(a) * 2 as integer) from test";
+  static const char import_query[] = "insert into test (a, b) values (:a, :b)";
+  db::query<clear_table_query>();
+  sqlite::ImportOptions options;
+  options.header = true;
+  options.threads = 3;
+  options.chunk_size = 8;
+  options.rows_per_transaction = 2;
+  options.empty_as_null = true;
+  std::istringstream csv_in(csv.str());
+  std::size_t imported = db::importCsv<insert_query>(csv_in, options);
+  assert(imported == 4);
+  std::istringstream ndjson_in(ndjson.str());
+  imported = db::importNdjson<import_query>(ndjson_in, options);
+  assert(imported == 4);
+
+  int count = 0;
+  int sum = 0;
+  bool has_row = db::query<count_query>()(count, sum);
+  assert(has_row && count == 8 && sum == 2 * 2 * 10.5);
+
+  // CSV fields are bound as text, and `test` has no column affinities.
+  static const char check_query[]
+    = "select b from test where cast(a as integer) = ?1";
+  std::vector<std::optional<std::string>> values;
+  for (auto fetch_row = db::query<check_query>(2); ; ) {
+    std::optional<std::string> b;
+    if (!fetch_row(b)) {
+      break;
+    }
+    values.push_back(b);
+  }
+  assert(values.size() == 2);
+  assert(values[0] == "needs, \"quoting\"\nhere" && values[0] == values[1]);
+  for (auto fetch_row = db::query<check_query>(3); ; ) {
+    std::optional<std::string> b = "";
+    if (!fetch_row(b)) {
+      break;
+    }
+    assert(!b);
+  }
+
+  // A one-column export writes NULLs as blank lines, which import as NULLs
+  // again rather than being skipped; empty strings are quoted.
+  static const char create_one_query[] = "create table one (v)";
+  static const char insert_one_query[] = "insert into one (v) values (?1)";
+  static const char select_one_query[] = "select v from one order by rowid";
+  static const char count_one_query[]
+    = "select count(*), count(v), sum(v = '') from one";
+  db::query<create_one_query>();
+  db::query<insert_one_query>(1);
+  db::query<insert_one_query>(std::nullopt);
+  db::query<insert_one_query>("");
+  db::query<insert_one_query>(3);
+  std::ostringstream one_csv;
+  exported = db::query<select_one_query>().exportCsv(one_csv);
+  assert(exported == 4 && one_csv.str() == "v\n1\n\n\"\"\n3\n");
+  static const char clear_one_query[] = "delete from one";
+  db::query<clear_one_query>();
+  std::istringstream one_in(one_csv.str());
+  imported = db::importCsv<insert_one_query>(one_in, options);
+  assert(imported == 4);
+  int non_null = 0, empty = 0;
+  has_row = db::query<count_one_query>()(count, non_null, empty);
+  assert(has_row && count == 4 && non_null == 3 && empty == 1);
+
+  // Malformed input is reported, and rolls back the current transaction.
+  db::query<clear_table_query>();
+  std::istringstream bad_in("{\"a\":1}\n{\"a\":2}\n{\"a\":\n");
+  options.rows_per_transaction = 0;
+  bool caught = false;
+  try {
+    db::importNdjson<import_query>(bad_in, options);
+  } catch (const sqlite::error &e) {
+    caught = (e.err_code == SQLITE_FORMAT);
+  }
+  assert(caught);
+  has_row = db::query<count_query>()(count, sum);
+  assert(has_row && count == 0);
+
+  // So is a failed commit, here of rows violating a deferred foreign key.
+  static const char foreign_keys_on_query[] = "pragma foreign_keys = on";
+  static const char foreign_keys_off_query[] = "pragma foreign_keys = off";
+  static const char create_parent_query[]
+    = "create table parent (id integer primary key)";
+  static const char create_child_query[]
+    = "create table child (parent_id references parent (id)"
+      " deferrable initially deferred)";
+  static const char insert_child_query[]
+    = "insert into child (parent_id) values (?1)";
+  static const char begin_query[] = "begin transaction";
+  db::query<foreign_keys_on_query>();
+  db::query<create_parent_query>();
+  db::query<create_child_query>();
+  std::istringstream orphans_in("1\n2\n3\n");
+  options.rows_per_transaction = 2;
+  caught = false;
+  try {
+    db::importCsv<insert_child_query>(orphans_in, options);
+  } catch (const sqlite::error &e) {
+    caught = (e.err_code == SQLITE_CONSTRAINT &&
+              e.query == "commit transaction");
+  }
+  assert(caught);
+  int begin_ret = db::query<begin_query>().resultCode();
+  assert(begin_ret == SQLITE_DONE);
+  db::rollbackTransaction();
+  db::query<foreign_keys_off_query>();
+}
+
+void test_error_details_and_logging(void) {
+  std::mutex log_mutex;
+  std::vector<std::pair<int, std::string>> log;
+  sqlite::LogOptions log_options;
+  log_options.sink = [&] (int err_code, std::string_view msg) {
+    std::lock_guard<std::mutex> guard(log_mutex);
+    log.emplace_back(err_code, msg);
+  };
+  log_options.max_messages_per_second = 1;
+  sqlite::configureLogging(log_options);
+
+  static const char bad_query[] = "select * from no_such_table";
+  bool caught = false;
+  try {
+    db::query<bad_query>();
+  } catch (const sqlite::error &e) {
+    assert(e.err_code == SQLITE_ERROR);
+    assert(e.message.find("no_such_table") != std::string::npos);
+    assert(std::string_view(e.what()) == e.message);
+    assert(e.query == bad_query);
+    caught = true;
+  }
+  assert(caught);
+
+  static const char create_unique_query[]
+    = "create table unique_test (a unique)";
+  static const char insert_unique_query[]
+    = "insert into unique_test (a) values (?1)";
+  db::query<create_unique_query>();
+  std::istringstream duplicates("1\n2\n2\n");
+  caught = false;
+  try {
+    db::importCsv<insert_unique_query>(duplicates);
+  } catch (const sqlite::error &e) {
+    assert(e.err_code == SQLITE_CONSTRAINT);
+    assert(e.extended_code == SQLITE_CONSTRAINT_UNIQUE);
+    assert(e.query == insert_unique_query);
+    caught = true;
+  }
+  assert(caught);
+
+  // Errors while stepping a statement aren't thrown, but can be asked for.
+  db::query<insert_unique_query>(1);
+  auto duplicate = db::query<insert_unique_query>(1);
+  int ret = duplicate.resultCode();
+  assert(ret == SQLITE_CONSTRAINT);
+  sqlite::error duplicate_error = duplicate.lastError();
+  assert(duplicate_error.extended_code == SQLITE_CONSTRAINT_UNIQUE);
+  assert(duplicate_error.message.find("unique_test.a") != std::string::npos);
+  assert(duplicate_error.query == insert_unique_query);
+
+  // SQLite logs each failure; beyond the first message in a second, they are
+  // only counted.
+  sqlite::flushLog();
+  {
+    std::lock_guard<std::mutex> guard(log_mutex);
+    assert(!log.empty() && log.size() < 4);
+    assert(log.front().second.find("no_such_table") != std::string::npos);
+    assert(log.back().second.find("log messages dropped") != std::string::npos);
+  }
+
+  sqlite::configureLogging(sqlite::LogOptions());
+}
+
+static const char hooks_db_name[] = ":memory:";
+using hooks_db = sqlite::Database<hooks_db_name>;
+
+void test_post_connection_hook_wins(void) {
+  // A commit hook installed by `post_connection_hook` isn't replaced by the
+  // wrapper's own.
+  static int commits = 0;
+  hooks_db::post_connection_hook = [] (sqlite3 *db_handle) {
+    sqlite3_commit_hook(db_handle, [] (void *) { commits++; return 0; },
+                        nullptr);
+  };
+  static const char create_table_query[] = "create table test (a, b)";
+  hooks_db::query<create_table_query>();
+  hooks_db::query<insert_query>(1, "hello");
+  assert(commits == 2);
+  hooks_db::disconnect();
+}
+
 int main(void)
 {
   static const char create_table_query[] = "create table test (a, b)";
@@ -64,4 +520,23 @@ int main(void)
 
   test_transactions();
   db::query<clear_table_query>();
+
+  test_optionals();
+  db::query<clear_table_query>();
+
+  test_arena();
+  db::query<clear_table_query>();
+
+  test_export_and_import();
+  db::query<clear_table_query>();
+
+  test_error_details_and_logging();
+
+  test_query_plans_and_slow_queries();
+
+  test_explicit_connections();
+
+  test_post_connection_hook_wins();
+
+  test_immutable_snapshot();
 }